@@ -0,0 +1,545 @@
+// Part of xbox-iso-vfs
+
+#include "daemon.h"
+
+#include "vfs_operations.h"
+
+#include <algorithm>
+#include <sstream>
+
+namespace vfs {
+namespace {
+constexpr static DWORD sc_pipeBufferSize = 4096;
+
+std::wstring fromUtf8(const std::string &text) {
+  if (text.empty()) {
+    return {};
+  }
+
+  auto length = MultiByteToWideChar(CP_UTF8, 0, text.data(),
+                                    static_cast<int>(text.size()), nullptr, 0);
+  std::wstring result(length, L'\0');
+  MultiByteToWideChar(CP_UTF8, 0, text.data(), static_cast<int>(text.size()),
+                      result.data(), length);
+
+  return result;
+}
+
+std::string toUtf8(const std::wstring &text) {
+  if (text.empty()) {
+    return {};
+  }
+
+  auto length =
+      WideCharToMultiByte(CP_UTF8, 0, text.data(), static_cast<int>(text.size()),
+                          nullptr, 0, nullptr, nullptr);
+  std::string result(length, '\0');
+  WideCharToMultiByte(CP_UTF8, 0, text.data(), static_cast<int>(text.size()),
+                      result.data(), length, nullptr, nullptr);
+
+  return result;
+}
+
+std::vector<std::string> tokenize(const std::string &line) {
+  std::vector<std::string> tokens;
+
+  std::string token;
+  bool quoted = false;
+  bool pending = false;
+
+  for (auto c : line) {
+    if (c == '"') {
+      quoted = !quoted;
+      pending = true;
+    } else if ((c == ' ' || c == '\t') && !quoted) {
+      if (pending) {
+        tokens.emplace_back(std::move(token));
+        token.clear();
+        pending = false;
+      }
+    } else {
+      token += c;
+      pending = true;
+    }
+  }
+
+  if (pending) {
+    tokens.emplace_back(std::move(token));
+  }
+
+  return tokens;
+}
+
+std::string describeDokanError(int status) {
+  switch (status) {
+  case DOKAN_DRIVE_LETTER_ERROR:
+    return "Dokan cannot use this drive letter";
+  case DOKAN_DRIVER_INSTALL_ERROR:
+    return "failed to communicate with the Dokan driver";
+  case DOKAN_START_ERROR:
+    return "Dokan failed to start";
+  case DOKAN_MOUNT_ERROR:
+  case DOKAN_MOUNT_POINT_ERROR:
+    return "Dokan failed to use this mount path";
+  case DOKAN_VERSION_ERROR:
+    return "the installed Dokan version is not compatible";
+  default:
+    return "Dokan error " + std::to_string(status);
+  }
+}
+} // namespace
+
+Daemon::Daemon(const Options &options) : m_options(options) {
+  ZeroMemory(&m_operations, sizeof(DOKAN_OPERATIONS));
+  vfs::setup(m_operations);
+
+  m_stopEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+
+  // The containers charge their own indexes; this only releases them
+  m_memoryId = MemoryGovernor::getDefault().addConsumer(
+      MemoryCategory::Index,
+      [this](uint64_t bytes) { return dropWarmContainers(bytes); });
+}
+
+Daemon::~Daemon() {
+  MemoryGovernor::getDefault().removeConsumer(m_memoryId);
+
+  for (auto &mount : m_mounts) {
+    DokanCloseHandle(mount->instance);
+  }
+
+  if (m_stopEvent) {
+    CloseHandle(m_stopEvent);
+  }
+}
+
+bool Daemon::run() {
+  if (!m_stopEvent) {
+    return false;
+  }
+
+  // Reused by every operation; each one resets it when it starts
+  auto ioEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+  if (!ioEvent) {
+    return false;
+  }
+
+  m_running = true;
+
+  while (m_running) {
+    // Only local clients; one client is served at a time
+    auto pipe = CreateNamedPipeW(
+        m_options.pipeName.c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+        PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT |
+            PIPE_REJECT_REMOTE_CLIENTS,
+        PIPE_UNLIMITED_INSTANCES, sc_pipeBufferSize, sc_pipeBufferSize, 0,
+        nullptr);
+    if (pipe == INVALID_HANDLE_VALUE) {
+      m_running = false;
+      CloseHandle(ioEvent);
+      return false;
+    }
+
+    OVERLAPPED overlapped{};
+    overlapped.hEvent = ioEvent;
+
+    DWORD transferred = 0;
+    auto started = ConnectNamedPipe(pipe, &overlapped);
+    auto connected = (!started && GetLastError() == ERROR_PIPE_CONNECTED) ||
+                     completeIo(pipe, overlapped, started, INFINITE,
+                                transferred);
+
+    if (connected && m_running) {
+      serveClient(pipe, ioEvent);
+    }
+
+    DisconnectNamedPipe(pipe);
+    CloseHandle(pipe);
+  }
+
+  CloseHandle(ioEvent);
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for (auto &mount : m_mounts) {
+    DokanCloseHandle(mount->instance);
+  }
+  m_mounts.clear();
+
+  return true;
+}
+
+void Daemon::stop() {
+  m_running = false;
+
+  // Wakes the server whether it waits for a client or a command
+  SetEvent(m_stopEvent);
+}
+
+bool Daemon::completeIo(HANDLE pipe, OVERLAPPED &overlapped, BOOL started,
+                        DWORD timeout, DWORD &transferred) {
+  if (!started && GetLastError() != ERROR_IO_PENDING) {
+    return false;
+  }
+
+  HANDLE events[] = {overlapped.hEvent, m_stopEvent};
+  if (WaitForMultipleObjects(2, events, FALSE, timeout) != WAIT_OBJECT_0) {
+    // The buffer must outlive the operation, so wait for the cancel to land
+    CancelIoEx(pipe, &overlapped);
+    GetOverlappedResult(pipe, &overlapped, &transferred, TRUE);
+    return false;
+  }
+
+  return GetOverlappedResult(pipe, &overlapped, &transferred, FALSE) != FALSE;
+}
+
+void Daemon::serveClient(HANDLE pipe, HANDLE ioEvent) {
+  std::string pending;
+  char buffer[sc_pipeBufferSize];
+
+  while (m_running) {
+    OVERLAPPED overlapped{};
+    overlapped.hEvent = ioEvent;
+
+    DWORD bytesRead = 0;
+    auto started = ReadFile(pipe, buffer, sizeof(buffer), nullptr, &overlapped);
+    if (!completeIo(pipe, overlapped, started, sc_clientTimeout, bytesRead) ||
+        bytesRead == 0) {
+      return;
+    }
+
+    pending.append(buffer, bytesRead);
+
+    size_t end;
+    while ((end = pending.find('\n')) != std::string::npos) {
+      auto line = pending.substr(0, end);
+      pending.erase(0, end + 1);
+
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+
+      auto reply = execute(line);
+
+      overlapped = OVERLAPPED{};
+      overlapped.hEvent = ioEvent;
+
+      DWORD bytesWritten = 0;
+      started = WriteFile(pipe, reply.data(), static_cast<DWORD>(reply.size()),
+                          nullptr, &overlapped);
+      if (!completeIo(pipe, overlapped, started, sc_clientTimeout,
+                      bytesWritten)) {
+        return;
+      }
+    }
+  }
+}
+
+std::string Daemon::execute(const std::string &line) {
+  auto tokens = tokenize(line);
+  if (tokens.empty()) {
+    return "error: empty command\n";
+  }
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  reapStoppedMounts();
+
+  const auto &command = tokens.front();
+  if (command == "mount" && tokens.size() == 3) {
+    return mount(fromUtf8(tokens[1]), fromUtf8(tokens[2]));
+  } else if (command == "unmount" && tokens.size() == 2) {
+    return unmount(fromUtf8(tokens[1]));
+  } else if (command == "swap" && tokens.size() == 3) {
+    return swap(fromUtf8(tokens[1]), fromUtf8(tokens[2]));
+  } else if (command == "list" && tokens.size() == 1) {
+    return list();
+  } else if (command == "stats" && tokens.size() == 1) {
+    return stats();
+  }
+
+  return "error: unknown command or wrong number of arguments\n";
+}
+
+std::string Daemon::mount(const std::wstring &imagePath,
+                          const std::wstring &mountPoint) {
+  for (const auto &mount : m_mounts) {
+    if (mount->mountPoint == mountPoint) {
+      return "error: mount path is already in use\n";
+    }
+  }
+
+  auto mount = std::make_unique<Mount>();
+  mount->imagePath = imagePath;
+  mount->mountPoint = mountPoint;
+
+  bool reused = false;
+  std::string error;
+  mount->container = acquireContainer(imagePath, reused, error);
+  if (!mount->container) {
+    return "error: " + error + "\n";
+  }
+
+  mount->volume = std::make_unique<Volume>(mount->container);
+
+  setupOptions(mount->options, *mount->volume, mount->mountPoint,
+               m_options.debugMode);
+
+  auto status = DokanCreateFileSystem(&mount->options, &m_operations,
+                                      &mount->instance);
+  if (status != DOKAN_SUCCESS) {
+    releaseContainer(mount->imagePath, std::move(mount->container));
+    return "error: " + describeDokanError(status) + "\n";
+  }
+
+  m_mounts.emplace_back(std::move(mount));
+
+  return reused ? "reused warm index\nok\n" : "ok\n";
+}
+
+std::string Daemon::unmount(const std::wstring &mountPoint) {
+  auto it = std::find_if(m_mounts.begin(), m_mounts.end(),
+                         [&mountPoint](const std::unique_ptr<Mount> &mount) {
+                           return mount->mountPoint == mountPoint;
+                         });
+  if (it == m_mounts.end()) {
+    return "error: nothing is mounted there\n";
+  }
+
+  // Waits until Dokan has released the mount
+  DokanCloseHandle((*it)->instance);
+
+  auto mount = std::move(*it);
+  m_mounts.erase(it);
+
+  releaseContainer(mount->imagePath, std::move(mount->container));
+
+  return "ok\n";
+}
+
+std::string Daemon::swap(const std::wstring &mountPoint,
+                         const std::wstring &imagePath) {
+  auto it = std::find_if(m_mounts.begin(), m_mounts.end(),
+                         [&mountPoint](const std::unique_ptr<Mount> &mount) {
+                           return mount->mountPoint == mountPoint;
+                         });
+  if (it == m_mounts.end()) {
+    return "error: nothing is mounted there\n";
+  }
+
+  auto &mount = **it;
+  if (mount.imagePath == imagePath) {
+    return "ok\n";
+  }
+
+  bool reused = false;
+  std::string error;
+  auto container = acquireContainer(imagePath, reused, error);
+  if (!container) {
+    return "error: " + error + "\n";
+  }
+
+  // Open handles keep their pinned container; it is freed with the last one
+  mount.volume->replace(container);
+
+  auto previousPath = std::move(mount.imagePath);
+  auto previous = std::move(mount.container);
+
+  mount.imagePath = imagePath;
+  mount.container = std::move(container);
+
+  releaseContainer(previousPath, std::move(previous));
+
+  return reused ? "reused warm index\nok\n" : "ok\n";
+}
+
+std::string Daemon::list() {
+  std::ostringstream reply;
+
+  for (const auto &mount : m_mounts) {
+    reply << toUtf8(mount->mountPoint) << "\t" << toUtf8(mount->imagePath)
+          << "\n";
+  }
+
+  reply << "ok\n";
+  return reply.str();
+}
+
+std::string Daemon::stats() {
+  std::ostringstream reply;
+
+  reply << "mounts " << m_mounts.size() << "\n";
+  reply << "warm " << m_warm.size() << "\n";
+
+  for (const auto &mount : m_mounts) {
+    reply << "mount " << toUtf8(mount->mountPoint) << " entries "
+          << mount->container->getEntryCount() << " reads "
+          << mount->container->getReadCount() << " bytes "
+          << mount->container->getReadBytes() << " swaps "
+          << mount->volume->getGeneration() << "\n";
+  }
+
+  for (const auto &store : m_stores) {
+    auto storeStats = store.second->getStats();
+    reply << "store " << toUtf8(store.first.wstring()) << " cache "
+          << storeStats.cacheBytes << "/" << storeStats.cacheBudget
+          << " hits " << storeStats.hits << " misses " << storeStats.misses
+          << "\n";
+  }
+
+  auto poolStats = xdvdfs::AlignedBufferPool::getDefault().getStats();
+  if (poolStats.acquisitions > 0) {
+    reply << "direct buffers " << poolStats.inUseBytes << "/"
+          << poolStats.allocatedBytes << " peak " << poolStats.peakInUseBytes
+          << " reads " << poolStats.acquisitions << " waits "
+          << poolStats.waits << "\n";
+  }
+
+  auto &governor = MemoryGovernor::getDefault();
+  auto memory = governor.getStats();
+
+  reply << "memory " << memory.used << "/" << memory.budget << " reclaims "
+        << memory.reclaimPasses << " pressure " << memory.pressureEvents
+        << (memory.pressureMonitor ? "" : " unmonitored") << "\n";
+
+  for (size_t i = 0; i < sc_memoryCategoryCount; ++i) {
+    reply << "memory "
+          << governor.getCategoryName(static_cast<MemoryCategory>(i))
+          << " used " << memory.categoryUsed[i] << " reclaimed "
+          << memory.categoryReclaimed[i] << "\n";
+  }
+
+  reply << "ok\n";
+  return reply.str();
+}
+
+std::shared_ptr<Container>
+Daemon::acquireContainer(const std::wstring &imagePath, bool &reused,
+                         std::string &error) {
+  // Already mounted elsewhere
+  for (const auto &mount : m_mounts) {
+    if (mount->imagePath == imagePath) {
+      reused = true;
+      return mount->container;
+    }
+  }
+
+  std::error_code errorCode;
+  auto modified = std::filesystem::last_write_time(imagePath, errorCode);
+  if (errorCode) {
+    error = "the image does not exist";
+    return nullptr;
+  }
+
+  // Warm and unchanged since it was indexed
+  for (auto it = m_warm.begin(); it != m_warm.end(); ++it) {
+    if (it->imagePath == imagePath) {
+      auto container = std::move(it->container);
+      auto unchanged = (it->modified == modified);
+      m_warm.erase(it);
+
+      if (unchanged) {
+        reused = true;
+        return container;
+      }
+      break;
+    }
+  }
+
+  auto container = std::make_shared<Container>();
+
+  std::filesystem::path path(imagePath);
+  SetupState status;
+
+  if (path.extension() == L".xidx") {
+    // Images from one store share its block cache
+    auto storeRoot = path.parent_path().parent_path();
+
+    auto &store = m_stores[storeRoot];
+    if (!store) {
+      store = std::make_unique<ContentStore>();
+      if (!store->open(storeRoot)) {
+        m_stores.erase(storeRoot);
+        error = "failed to open the content store";
+        return nullptr;
+      }
+    }
+
+    status = container->setupFromIndex(path, *store);
+  } else {
+    status = container->setup(imagePath);
+  }
+
+  switch (status) {
+  case SetupState::ErrorFile:
+    error = "failed to open the image";
+    return nullptr;
+  case SetupState::ErrorFormat:
+    error = "not an Xbox ISO image";
+    return nullptr;
+  case SetupState::Success:
+    break;
+  }
+
+  return container;
+}
+
+void Daemon::releaseContainer(const std::wstring &imagePath,
+                              std::shared_ptr<Container> container) {
+  for (const auto &other : m_mounts) {
+    if (other->container == container) {
+      return;
+    }
+  }
+
+  std::error_code errorCode;
+  auto modified = std::filesystem::last_write_time(imagePath, errorCode);
+  if (errorCode) {
+    return;
+  }
+
+  m_warm.push_front({imagePath, modified, std::move(container)});
+
+  while (m_warm.size() > m_options.warmLimit) {
+    m_warm.pop_back();
+  }
+}
+
+uint64_t Daemon::dropWarmContainers(uint64_t bytes) {
+  std::list<WarmContainer> dropped;
+  uint64_t released = 0;
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    while (released < bytes && !m_warm.empty()) {
+      // Containers still read by open handles are not freed yet
+      const auto &oldest = m_warm.back();
+      if (oldest.container.use_count() == 1) {
+        released += oldest.container->getIndexSize();
+      }
+
+      dropped.splice(dropped.end(), m_warm, std::prev(m_warm.end()));
+    }
+  }
+
+  // Destroyed outside the lock
+  return released;
+}
+
+void Daemon::reapStoppedMounts() {
+  // Mounts removed externally, e.g. with dokanctl
+  for (auto it = m_mounts.begin(); it != m_mounts.end();) {
+    if (DokanIsFileSystemRunning((*it)->instance)) {
+      ++it;
+      continue;
+    }
+
+    DokanCloseHandle((*it)->instance);
+
+    auto mount = std::move(*it);
+    it = m_mounts.erase(it);
+
+    releaseContainer(mount->imagePath, std::move(mount->container));
+  }
+}
+} // namespace vfs
@@ -0,0 +1,114 @@
+// Part of xbox-iso-vfs
+
+#pragma once
+
+#include <dokan/dokan.h>
+
+#include "vfs.h"
+#include "vfs_memory.h"
+#include "vfs_store.h"
+#include "vfs_volume.h"
+
+#include <atomic>
+#include <filesystem>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace vfs {
+// Long running process which mounts and unmounts images on request from a
+// local named pipe. Commands are single lines of UTF-8; arguments containing
+// spaces are wrapped in double quotes. Every reply ends with an "ok" or
+// "error: <reason>" line. Clients are served one at a time, and one which
+// sends nothing or stops reading for sc_clientTimeout is disconnected so it
+// cannot hold up the others
+//
+//   mount <iso_file|xidx> <mount_path>
+//   unmount <mount_path>
+//   swap <mount_path> <iso_file|xidx>
+//   list
+//   stats
+//
+// Containers of unmounted images are kept warm and reused when the same,
+// unchanged image is mounted again. Swapping replaces the image behind a
+// mount without unmounting; handles opened before the swap keep reading the
+// previous image until they are closed. Under memory pressure the oldest warm
+// containers are dropped first
+class Daemon {
+public:
+  constexpr static const wchar_t *sc_defaultPipeName =
+      L"\\\\.\\pipe\\xbox-iso-vfs";
+  constexpr static DWORD sc_clientTimeout = 5000; ///< milliseconds
+
+  struct Options {
+    std::wstring pipeName{sc_defaultPipeName};
+    bool debugMode{false};
+    size_t warmLimit{8}; ///< unmounted containers kept for reuse
+  };
+
+  explicit Daemon(const Options &options);
+  ~Daemon();
+
+  // Serves the control pipe until stop is called
+  bool run();
+  void stop();
+
+private:
+  struct Mount {
+    std::wstring imagePath;
+    std::wstring mountPoint;
+    std::shared_ptr<Container> container; ///< currently published
+    std::unique_ptr<Volume> volume;
+    DOKAN_OPTIONS options;
+    DOKAN_HANDLE instance{nullptr};
+  };
+
+  struct WarmContainer {
+    std::wstring imagePath;
+    std::filesystem::file_time_type modified;
+    std::shared_ptr<Container> container;
+  };
+
+  void serveClient(HANDLE pipe, HANDLE ioEvent);
+
+  // Waits for an overlapped operation on the pipe, cancelling it on timeout
+  // or once stopped. Returns false unless it completed
+  bool completeIo(HANDLE pipe, OVERLAPPED &overlapped, BOOL started,
+                  DWORD timeout, DWORD &transferred);
+  std::string execute(const std::string &line);
+
+  std::string mount(const std::wstring &imagePath,
+                    const std::wstring &mountPoint);
+  std::string unmount(const std::wstring &mountPoint);
+  std::string swap(const std::wstring &mountPoint,
+                   const std::wstring &imagePath);
+  std::string list();
+  std::string stats();
+
+  std::shared_ptr<Container> acquireContainer(const std::wstring &imagePath,
+                                              bool &reused,
+                                              std::string &error);
+  void releaseContainer(const std::wstring &imagePath,
+                        std::shared_ptr<Container> container);
+  void reapStoppedMounts();
+
+  // Governor reclaimer; returns the index memory released
+  uint64_t dropWarmContainers(uint64_t bytes);
+
+  Options m_options;
+  DOKAN_OPERATIONS m_operations;
+
+  std::atomic<bool> m_running{false};
+  HANDLE m_stopEvent{nullptr};
+
+  std::mutex m_mutex;
+  std::vector<std::unique_ptr<Mount>> m_mounts;
+  std::list<WarmContainer> m_warm; // most recently unmounted first
+  std::map<std::filesystem::path, std::unique_ptr<ContentStore>> m_stores;
+
+  MemoryGovernor::ConsumerId m_memoryId{0};
+};
+} // namespace vfs
@@ -3,15 +3,32 @@
 #include <dokan/dokan.h>
 #include <dokan/fileinfo.h>
 
+#include "daemon.h"
 #include "vfs.h"
+#include "vfs_erofs.h"
+#include "vfs_find.h"
+#include "vfs_ingest.h"
+#include "vfs_layout.h"
+#include "vfs_memory.h"
 #include "vfs_operations.h"
+#include "vfs_resident.h"
+#include "vfs_sparse.h"
+#include "vfs_store.h"
+#include "vfs_volume.h"
 
+#include <algorithm>
 #include <chrono>
 #include <cstdio>
+#include <cwchar>
+#include <cwctype>
 #include <filesystem>
+#include <fcntl.h>
+#include <fstream>
+#include <io.h>
 #include <iostream>
 #include <string>
 #include <thread>
+#include <vector>
 
 template <class T> class Singleton {
 public:
@@ -36,12 +53,72 @@ public:
     std::wstring mountPoint;
     bool debugMode{false};
     bool launchMountPath{false};
+    bool residentMode{false};
+    bool directIO{false};
+    uint64_t memoryBudget{0}; ///< bytes, 0 when unlimited
+    std::vector<std::string> residentPaths;
+    std::wstring tracePath;
+
+    std::wstring layoutOutput;
+    std::wstring sparseOutput;
+    std::wstring erofsOutput;
+
+    bool daemonMode{false};
+    std::wstring pipeName{vfs::Daemon::sc_defaultPipeName};
+
+    std::wstring findPattern;
+    std::wstring storePath;
+    std::vector<std::wstring> images;
+
+    std::wstring ingestInput; ///< image to ingest, or - for stdin
+    std::wstring ingestName;
+    std::wstring extractPath;
+    std::wstring trimmedOutput;
   };
 
   App(const Parameters &params) : m_params(params) {}
 
   void run() {
-    auto status = m_vfsContainer.setup(m_params.filePath);
+    if (m_params.memoryBudget > 0) {
+      vfs::MemoryGovernor::getDefault().setBudget(m_params.memoryBudget);
+    }
+
+    if (m_params.daemonMode) {
+      runDaemon();
+      return;
+    }
+
+    if (!m_params.findPattern.empty()) {
+      runFind();
+      return;
+    }
+
+    if (!m_params.layoutOutput.empty()) {
+      runLayout();
+      return;
+    }
+
+    if (!m_params.sparseOutput.empty()) {
+      runSparseCopy();
+      return;
+    }
+
+    if (!m_params.erofsOutput.empty()) {
+      runErofsExport();
+      return;
+    }
+
+    if (!m_params.ingestInput.empty()) {
+      runIngest();
+      return;
+    }
+
+    if (!m_params.storePath.empty()) {
+      runImport();
+      return;
+    }
+
+    auto status = setupContainer();
     switch (status) {
     case vfs::SetupState::ErrorFile:
       std::wcout << "Failed to open file " << m_params.filePath << "\n";
@@ -54,11 +131,325 @@ public:
                     "this ISO\n";
       break;
     case vfs::SetupState::Success:
+      if (m_params.residentMode) {
+        loadResident();
+      }
+      if (!m_params.tracePath.empty() && !startTrace()) {
+        break;
+      }
       runDokan();
       break;
     }
   }
 
+  void loadResident() {
+    auto report = vfs::makeResident(*m_vfsContainer, m_params.residentPaths);
+    if (!report.success) {
+      std::wcout << "Failed to load the image into memory. Reads will be "
+                    "served from the file\n";
+      return;
+    }
+
+    const wchar_t *hugePages = L"none";
+    switch (report.hugePages) {
+    case vfs::HugePages::None:
+      break;
+    case vfs::HugePages::Transparent:
+      hugePages = L"transparent";
+      break;
+    case vfs::HugePages::Explicit:
+      hugePages = L"explicit";
+      break;
+    }
+
+    std::wcout << "Resident: " << report.residentBytes / (1024 * 1024)
+               << " MiB in " << report.extentCount << " extents ("
+               << report.fileCount << " files), huge pages: " << hugePages
+               << "\n";
+    std::wcout << "Load time: " << report.loadTime.count()
+               << "s, mean 4 KiB read: " << report.readLatencyNs << "ns\n";
+  }
+
+  void runDaemon() {
+    DokanInit();
+
+    vfs::Daemon::Options options;
+    options.pipeName = m_params.pipeName;
+    options.debugMode = m_params.debugMode;
+
+    m_daemon = std::make_unique<vfs::Daemon>(options);
+
+    vfs::MemoryGovernor::getDefault().startPressureMonitor();
+
+    SetConsoleCtrlHandler(CtrlHandler, TRUE);
+
+    std::wcout << "Listening on " << m_params.pipeName << "\n";
+    if (!m_daemon->run()) {
+      std::wcout << "Failed to create the control pipe " << m_params.pipeName
+                 << "\n";
+    }
+
+    DokanShutdown();
+  }
+
+  vfs::SetupState setupContainer() {
+    std::filesystem::path path(m_params.filePath);
+
+    // Indexes live in <store>/images/
+    if (path.extension() == L".xidx") {
+      if (!m_contentStore.open(path.parent_path().parent_path())) {
+        return vfs::SetupState::ErrorFile;
+      }
+
+      return m_vfsContainer->setupFromIndex(path, m_contentStore);
+    }
+
+    auto status = m_vfsContainer->setup(m_params.filePath, m_params.directIO);
+
+    auto stream = m_vfsContainer->getFileStream();
+    if (status == vfs::SetupState::Success && stream &&
+        stream->isDirectUnsupported()) {
+      std::wcout << "Direct I/O is not supported on this volume; the image "
+                    "is read through the file cache\n";
+    }
+
+    return status;
+  }
+
+  void runImport() {
+    if (!m_contentStore.open(m_params.storePath)) {
+      std::wcout << "Failed to open the content store " << m_params.storePath
+                 << "\n";
+      return;
+    }
+
+    for (const auto &image : m_params.images) {
+      vfs::Container container;
+      if (container.setup(image) != vfs::SetupState::Success) {
+        std::wcout << "Skipped " << image << " (not an Xbox ISO image)\n";
+        continue;
+      }
+
+      auto report = vfs::importImage(m_contentStore, container);
+      if (!report.success) {
+        std::wcout << "Failed to import " << image << "\n";
+        continue;
+      }
+
+      std::wcout << "Imported " << image << " as "
+                 << report.indexPath.wstring() << "\n";
+      if (report.renamed) {
+        std::wcout << "  A different image is already indexed as "
+                   << container.getFilename()
+                   << ", so the name was given a suffix\n";
+      }
+      std::wcout << "  " << report.files << " files, " << report.newObjects
+                 << " new objects, " << report.newBytes / 1024
+                 << " KiB added, " << report.sharedBytes / 1024
+                 << " KiB shared\n";
+    }
+  }
+
+  void runIngest() {
+    if (!m_contentStore.open(m_params.storePath)) {
+      std::wcout << "Failed to open the content store " << m_params.storePath
+                 << "\n";
+      return;
+    }
+
+    vfs::IngestOptions options;
+    options.name = m_params.ingestName;
+    options.extractPath = m_params.extractPath;
+    options.trimmedPath = m_params.trimmedOutput;
+
+    std::ifstream file;
+    std::istream *input = &std::cin;
+
+    if (m_params.ingestInput == L"-") {
+      _setmode(_fileno(stdin), _O_BINARY);
+    } else {
+      file.open(std::filesystem::path(m_params.ingestInput), std::ios::binary);
+      if (!file.is_open()) {
+        std::wcout << "Failed to open file " << m_params.ingestInput << "\n";
+        return;
+      }
+      input = &file;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto report = vfs::ingestImage(*input, m_contentStore, options);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    if (!report.success) {
+      if (report.state == vfs::SetupState::ErrorFormat) {
+        std::wcout << "Failed to read " << m_params.ingestInput
+                   << " as an Xbox ISO image\n";
+      } else if (report.unresolvedEntries > 0) {
+        std::wcout << report.unresolvedEntries
+                   << " entries were stored before their directory table and "
+                      "were no longer buffered\n";
+        std::wcout << "Use /si to import this image from a file\n";
+      } else {
+        std::wcout << "Failed to ingest " << m_params.ingestInput << "\n";
+      }
+      return;
+    }
+
+    std::wcout << "Ingested " << m_params.ingestInput << " as "
+               << report.indexPath.wstring() << "\n";
+    if (report.renamed) {
+      std::wcout << "  A different image is already indexed as "
+                 << m_params.ingestName << ", so the name was given a suffix\n";
+    }
+    std::wcout << "  " << report.files << " files, " << report.newObjects
+               << " new objects, " << report.newBytes / 1024 << " KiB added, "
+               << report.sharedBytes / 1024 << " KiB shared\n";
+    if (!m_params.extractPath.empty()) {
+      std::wcout << "  " << report.extractedFiles << " files extracted to "
+                 << m_params.extractPath << "\n";
+    }
+    if (!m_params.trimmedOutput.empty()) {
+      std::wcout << "  Wrote " << m_params.trimmedOutput << " ("
+                 << report.trimmedSize / (1024 * 1024) << " MiB)\n";
+    }
+
+    auto hash = vfs::Sha256::toString(report.imageHash);
+    std::wcout << "  SHA-256 " << std::wstring(hash.begin(), hash.end())
+               << "\n";
+
+    auto mebibytes = static_cast<double>(report.bytesRead) / (1024 * 1024);
+    std::wcout << "  " << static_cast<uint64_t>(mebibytes) << " MiB read in "
+               << elapsed.count() << "s ("
+               << static_cast<uint64_t>(
+                      mebibytes / std::max(elapsed.count(), 0.001))
+               << " MiB/s), " << report.peakBufferedBytes / (1024 * 1024)
+               << " MiB buffered at most\n";
+  }
+
+  bool startTrace() {
+    if (!m_accessTrace.open(m_params.tracePath,
+                            m_vfsContainer->getEntryCount())) {
+      std::wcout << "Failed to create the trace file " << m_params.tracePath
+                 << "\n";
+      return false;
+    }
+
+    m_vfsContainer->setAccessTrace(&m_accessTrace);
+    return true;
+  }
+
+  void runLayout() {
+    auto status = m_vfsContainer->setup(m_params.filePath);
+    if (status != vfs::SetupState::Success) {
+      std::wcout << "Failed to read file " << m_params.filePath
+                 << " as an Xbox ISO image\n";
+      return;
+    }
+
+    std::vector<std::string> order;
+    if (!vfs::readAccessOrder(m_params.tracePath, order)) {
+      std::wcout << "Failed to read trace " << m_params.tracePath << "\n";
+      return;
+    }
+
+    auto report =
+        vfs::rewriteImage(*m_vfsContainer, order, m_params.layoutOutput);
+
+    if (!report.success) {
+      std::wcout << "Failed to write " << m_params.layoutOutput << "\n";
+      return;
+    }
+
+    std::wcout << "Wrote " << m_params.layoutOutput << " ("
+               << report.outputSize / (1024 * 1024) << " MiB)\n";
+    std::wcout << report.orderedFiles << " of " << report.totalFiles
+               << " files placed in access order, "
+               << report.directoryTables << " directory tables\n";
+    for (const auto &path : report.unmatchedPaths) {
+      std::wcout << "Not in the image: "
+                 << std::wstring(path.begin(), path.end()) << "\n";
+    }
+  }
+
+  void runSparseCopy() {
+    auto status = m_vfsContainer->setup(m_params.filePath);
+    if (status != vfs::SetupState::Success) {
+      std::wcout << "Failed to read file " << m_params.filePath
+                 << " as an Xbox ISO image\n";
+      return;
+    }
+
+    auto report = vfs::sparseCopy(*m_vfsContainer, m_params.sparseOutput);
+    if (!report.success) {
+      std::wcout << "Failed to write " << m_params.sparseOutput << "\n";
+      return;
+    }
+
+    std::wcout << "Wrote " << m_params.sparseOutput << " ("
+               << report.imageSize / (1024 * 1024) << " MiB, "
+               << report.copiedBytes / (1024 * 1024) << " MiB in use, "
+               << report.allocatedSize / (1024 * 1024)
+               << " MiB on disk)\n";
+    if (!report.sparse) {
+      std::wcout << "The output volume does not support sparse files\n";
+    }
+  }
+
+  void runErofsExport() {
+    auto status = m_vfsContainer->setup(m_params.filePath);
+    if (status != vfs::SetupState::Success) {
+      std::wcout << "Failed to read file " << m_params.filePath
+                 << " as an Xbox ISO image\n";
+      return;
+    }
+
+    auto report = vfs::exportErofs(*m_vfsContainer, m_params.erofsOutput);
+    if (!report.success) {
+      std::wcout << "Failed to write " << m_params.erofsOutput << "\n";
+      return;
+    }
+
+    std::wcout << "Wrote " << m_params.erofsOutput << " ("
+               << report.imageSize / (1024 * 1024) << " MiB, "
+               << report.files << " files, " << report.directories
+               << " directories)\n";
+  }
+
+  void runFind() {
+    vfs::FindQuery query;
+    if (!vfs::FindQuery::parse(std::string(m_params.findPattern.begin(),
+                                           m_params.findPattern.end()),
+                               query)) {
+      std::wcout << "The pattern " << m_params.findPattern
+                 << " is not a valid regular expression. Use --help to see "
+                    "usage\n";
+      return;
+    }
+
+    auto results = vfs::findInImages(m_params.images, query);
+
+    for (const auto &match : results.matches) {
+      std::wcout << m_params.images[match.imageIndex] << ": "
+                 << std::wstring(match.path.begin(), match.path.end());
+      if (!match.isDirectory) {
+        std::wcout << " (" << match.fileSize << " bytes)";
+      }
+      std::wcout << "\n";
+    }
+
+    for (const auto &failure : results.failures) {
+      std::wcout << "Skipped " << m_params.images[failure.first]
+                 << (failure.second == vfs::SetupState::ErrorFile
+                         ? L" (failed to open)\n"
+                         : L" (not an Xbox ISO image)\n");
+    }
+
+    std::wcout << results.matches.size() << " matches in "
+               << m_params.images.size() - results.failures.size()
+               << " images\n";
+  }
+
   static void fileWatcher(std::wstring path) {
 
     std::filesystem::path mp(path);
@@ -75,21 +466,13 @@ public:
 
     DokanInit();
 
-    DOKAN_OPTIONS dokanOptions;
-    ZeroMemory(&dokanOptions, sizeof(DOKAN_OPTIONS));
+    vfs::MemoryGovernor::getDefault().startPressureMonitor();
 
-    dokanOptions.Version = DOKAN_VERSION;
-    dokanOptions.SingleThread = FALSE;
-    dokanOptions.Timeout = 0;
-    dokanOptions.GlobalContext = reinterpret_cast<ULONG64>(&m_vfsContainer);
-    dokanOptions.MountPoint = m_params.mountPoint.c_str();
-    dokanOptions.Options |= DOKAN_OPTION_ALT_STREAM;
-    dokanOptions.Options |= DOKAN_OPTION_WRITE_PROTECT;
-    dokanOptions.Options |= DOKAN_OPTION_CURRENT_SESSION;
+    vfs::Volume volume(m_vfsContainer);
 
-    if (m_params.debugMode) {
-      dokanOptions.Options |= DOKAN_OPTION_STDERR | DOKAN_OPTION_DEBUG;
-    }
+    DOKAN_OPTIONS dokanOptions;
+    vfs::setupOptions(dokanOptions, volume, m_params.mountPoint,
+                      m_params.debugMode);
 
     SetConsoleCtrlHandler(CtrlHandler, TRUE);
 
@@ -158,13 +541,82 @@ public:
     std::wcout
         << "xbox-iso-vfs is a utility to mount Xbox ISO files on Windows\n";
     std::wcout << "Written by x1nixmzeng\n\n";
-    std::wcout << "xbox-iso-vfs.exe [/d|/l] <iso_file> <mount_path>\n";
+    std::wcout << "xbox-iso-vfs.exe [/d|/l|/r|/rl <list>|/direct|/m <mib>] "
+                  "<iso_file> <mount_path>\n";
+    std::wcout << "xbox-iso-vfs.exe [/d|/m <mib>] /daemon [pipe_name]\n";
+    std::wcout << "xbox-iso-vfs.exe /o <trace> <iso_file> <output_iso>\n";
+    std::wcout << "xbox-iso-vfs.exe /sc <iso_file> <output_iso>\n";
+    std::wcout << "xbox-iso-vfs.exe /erofs <iso_file> <output_img>\n";
+    std::wcout << "xbox-iso-vfs.exe /si <store_path> <iso_file|folder>...\n";
+    std::wcout << "xbox-iso-vfs.exe /ingest <store_path> <iso_file|-> "
+                  "[/n <name>] [/x <folder>]\n"
+                  "                 [/trim <output_iso>]\n";
+    std::wcout << "xbox-iso-vfs.exe /f <pattern> <iso_file|folder>...\n";
     std::wcout
         << "  /d           Display debug Dokan output in console window\n";
     std::wcout << "  /l           Open Windows Explorer to the mount path\n";
-    std::wcout << "  <iso_file>   Path to the Xbox ISO file to mount\n";
+    std::wcout << "  <iso_file>   Path to the Xbox ISO file to mount, or an "
+                  "imported .xidx\n";
+    std::wcout << "               index in <store_path>\\images\n";
+    std::wcout << "               Split images are opened from any part "
+                  "(name.1.iso, name.2.iso, ...)\n";
     std::wcout << "  <mount_path> Driver letter (\"M:\\\") or folder path on "
                   "NTFS partition\n";
+    std::wcout << "  /r           Load the whole game partition into memory "
+                  "before mounting\n";
+    std::wcout << "  /rl <list>   Load only the paths listed in the file "
+                  "<list> into memory\n";
+    std::wcout << "  /direct      Read the image around the Windows file "
+                  "cache, through a fixed\n";
+    std::wcout << "               pool of aligned buffers. Falls back to "
+                  "cached reads, with a\n";
+    std::wcout << "               warning, where the volume does not allow "
+                  "it\n";
+    std::wcout << "  /m <mib>     Budget for caches and indexes; beyond it, "
+                  "or under system\n";
+    std::wcout << "               memory pressure, cold cache blocks and "
+                  "idle indexes are freed\n";
+    std::wcout << "  /daemon      Serve mount, unmount, swap, list and stats "
+                  "commands on a named\n";
+    std::wcout << "               pipe (default \\\\.\\pipe\\xbox-iso-vfs)\n";
+    std::wcout << "  /t <trace>   Record the order files are first read in "
+                  "to <trace>\n";
+    std::wcout << "  /o           Rewrite the image with files placed in the "
+                  "order listed\n";
+    std::wcout << "               in <trace>, after all of the directory "
+                  "tables. A hand\n";
+    std::wcout << "               written profile may list paths with / or "
+                  "\\, with or\n";
+    std::wcout << "               without the leading root; unknown paths "
+                  "are reported\n";
+    std::wcout << "  /sc          Copy the image writing only the sectors in "
+                  "use, leaving the\n";
+    std::wcout << "               video partition and padding as sparse "
+                  "holes\n";
+    std::wcout << "  /erofs       Convert the image to an EROFS image, which "
+                  "Linux mounts with\n";
+    std::wcout << "               \"mount -t erofs -o loop <output_img> "
+                  "<dir>\"\n";
+    std::wcout << "  /si          Import the images into the deduplicated "
+                  "content store\n";
+    std::wcout << "               at <store_path>\n";
+    std::wcout << "  /ingest      Import one image read once, front to back, "
+                  "from a file or\n";
+    std::wcout << "               from stdin (-), optionally extracting it "
+                  "(/x) and writing a\n";
+    std::wcout << "               trimmed copy (/trim) in the same pass. The "
+                  "index is named\n";
+    std::wcout << "               <name>, by default after the file\n";
+    std::wcout << "  /f           Search the images for entries matching "
+                  "<pattern>\n";
+    std::wcout << "               *.xmv and ?ame are globs, /regex/ is a "
+                  "regular expression,\n";
+    std::wcout << "               anything else is a substring. Patterns "
+                  "with a \\ or / match\n";
+    std::wcout << "               the full path; in a /regex/ only an "
+                  "unescaped / does, and\n";
+    std::wcout << "               matches either separator. Folders are "
+                  "searched for .iso files\n";
     std::wcout << "  /h           Show usage\n\n";
     std::wcout << "Unmount with CTRL + C in the console or alternatively via "
                   "\"dokanctl /u mount_path\".\n\n";
@@ -184,6 +636,49 @@ public:
       } else if (arg == L"--launch" || arg == L"/l") {
         params.launchMountPath = true;
         continue;
+      } else if (arg == L"--resident" || arg == L"/r") {
+        params.residentMode = true;
+        continue;
+      } else if (arg == L"--direct" || arg == L"/direct") {
+        params.directIO = true;
+        continue;
+      } else if ((arg == L"--memory" || arg == L"/m") && i + 1 < argc) {
+        wchar_t *end = nullptr;
+        auto mebibytes = std::wcstoull(argv[++i], &end, 10);
+        if (*end != L'\0' || mebibytes == 0) {
+          std::wcout << "The memory budget should be a number of MiB\n";
+          return false;
+        }
+        params.memoryBudget = mebibytes * 1024 * 1024;
+        continue;
+      } else if ((arg == L"--resident-list" || arg == L"/rl") &&
+                 i + 1 < argc) {
+        params.residentMode = true;
+        if (!readResidentList(params, argv[++i])) {
+          return false;
+        }
+        continue;
+      } else if ((arg == L"--trace" || arg == L"/t") && i + 1 < argc) {
+        params.tracePath = argv[++i];
+        continue;
+      } else if (arg == L"--optimize" || arg == L"/o") {
+        return readLayoutParameters(params, i + 1, argc, argv);
+      } else if (arg == L"--sparse-copy" || arg == L"/sc") {
+        return readSparseCopyParameters(params, i + 1, argc, argv);
+      } else if (arg == L"--erofs" || arg == L"/erofs") {
+        return readErofsParameters(params, i + 1, argc, argv);
+      } else if (arg == L"--daemon" || arg == L"/daemon") {
+        params.daemonMode = true;
+        if (i + 1 < argc) {
+          params.pipeName = argv[i + 1];
+        }
+        return true;
+      } else if (arg == L"--store-import" || arg == L"/si") {
+        return readImportParameters(params, i + 1, argc, argv);
+      } else if (arg == L"--ingest" || arg == L"/ingest") {
+        return readIngestParameters(params, i + 1, argc, argv);
+      } else if (arg == L"--find" || arg == L"/f") {
+        return readFindParameters(params, i + 1, argc, argv);
       } else if (i + 1 >= argc) {
         std::wcout << "Missing mount_path parameter. Use --help to see usage\n";
         return false;
@@ -223,6 +718,201 @@ public:
     return true;
   }
 
+  static bool readResidentList(App::Parameters &params,
+                               const std::filesystem::path &listPath) {
+    std::ifstream list(listPath);
+    if (!list.is_open()) {
+      std::wcout << "Failed to open the resident list " << listPath.wstring()
+                 << "\n";
+      return false;
+    }
+
+    std::string line;
+    while (std::getline(list, line)) {
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+      if (!line.empty()) {
+        params.residentPaths.emplace_back(line);
+      }
+    }
+
+    return true;
+  }
+
+  static bool readLayoutParameters(App::Parameters &params, int first,
+                                   int argc, wchar_t **argv) {
+    if (first + 3 > argc) {
+      std::wcout << "Expected <trace> <iso_file> <output_iso>. Use --help to "
+                    "see usage\n";
+      return false;
+    }
+
+    params.tracePath = argv[first];
+    params.filePath = argv[first + 1];
+    params.layoutOutput = argv[first + 2];
+
+    std::error_code errorCode;
+    for (const auto &path : {params.tracePath, params.filePath}) {
+      if (std::filesystem::exists(path, errorCode) == false) {
+        std::wcout << "The file " << path << " does not exist\n";
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  static bool readErofsParameters(App::Parameters &params, int first,
+                                  int argc, wchar_t **argv) {
+    if (first + 2 > argc) {
+      std::wcout << "Expected <iso_file> <output_img>. Use --help to see "
+                    "usage\n";
+      return false;
+    }
+
+    params.filePath = argv[first];
+    params.erofsOutput = argv[first + 1];
+
+    std::error_code errorCode;
+    if (std::filesystem::exists(params.filePath, errorCode) == false) {
+      std::wcout << "The file " << params.filePath << " does not exist\n";
+      return false;
+    }
+
+    return true;
+  }
+
+  static bool readSparseCopyParameters(App::Parameters &params, int first,
+                                       int argc, wchar_t **argv) {
+    if (first + 2 > argc) {
+      std::wcout << "Expected <iso_file> <output_iso>. Use --help to see "
+                    "usage\n";
+      return false;
+    }
+
+    params.filePath = argv[first];
+    params.sparseOutput = argv[first + 1];
+
+    std::error_code errorCode;
+    if (std::filesystem::exists(params.filePath, errorCode) == false) {
+      std::wcout << "The file " << params.filePath << " does not exist\n";
+      return false;
+    }
+
+    return true;
+  }
+
+  static bool readFindParameters(App::Parameters &params, int first,
+                                 int argc, wchar_t **argv) {
+    if (first >= argc) {
+      std::wcout << "Missing pattern parameter. Use --help to see usage\n";
+      return false;
+    }
+
+    params.findPattern = argv[first];
+
+    return readImageList(params, first + 1, argc, argv);
+  }
+
+  static bool readImportParameters(App::Parameters &params, int first,
+                                   int argc, wchar_t **argv) {
+    if (first >= argc) {
+      std::wcout << "Missing store_path parameter. Use --help to see usage\n";
+      return false;
+    }
+
+    params.storePath = argv[first];
+
+    return readImageList(params, first + 1, argc, argv);
+  }
+
+  static bool readIngestParameters(App::Parameters &params, int first,
+                                   int argc, wchar_t **argv) {
+    if (first + 2 > argc) {
+      std::wcout << "Expected <store_path> <iso_file|->. Use --help to see "
+                    "usage\n";
+      return false;
+    }
+
+    params.storePath = argv[first];
+    params.ingestInput = argv[first + 1];
+
+    for (int i = first + 2; i < argc; ++i) {
+      auto arg = std::wstring(argv[i]);
+
+      if (i + 1 >= argc) {
+        std::wcout << "Missing value for " << arg
+                   << ". Use --help to see usage\n";
+        return false;
+      } else if (arg == L"--name" || arg == L"/n") {
+        params.ingestName = argv[++i];
+      } else if (arg == L"--extract" || arg == L"/x") {
+        params.extractPath = argv[++i];
+      } else if (arg == L"--trim" || arg == L"/trim") {
+        params.trimmedOutput = argv[++i];
+      } else {
+        std::wcout << "Unknown option " << arg << ". Use --help to see usage\n";
+        return false;
+      }
+    }
+
+    std::error_code errorCode;
+    if (params.ingestInput != L"-" &&
+        std::filesystem::exists(params.ingestInput, errorCode) == false) {
+      std::wcout << "The file " << params.ingestInput << " does not exist\n";
+      return false;
+    }
+
+    if (params.ingestName.empty()) {
+      if (params.ingestInput == L"-") {
+        std::wcout << "Name the image with /n when reading from stdin\n";
+        return false;
+      }
+      params.ingestName =
+          std::filesystem::path(params.ingestInput).stem().wstring();
+    }
+
+    return true;
+  }
+
+  static bool readImageList(App::Parameters &params, int first, int argc,
+                            wchar_t **argv) {
+    std::error_code errorCode;
+    for (int i = first; i < argc; ++i) {
+      std::filesystem::path path(argv[i]);
+
+      if (std::filesystem::is_directory(path, errorCode)) {
+        for (auto it = std::filesystem::recursive_directory_iterator(
+                 path, errorCode);
+             it != std::filesystem::recursive_directory_iterator();
+             it.increment(errorCode)) {
+          auto extension = it->path().extension().wstring();
+          std::transform(extension.begin(), extension.end(),
+                         extension.begin(), ::towlower);
+
+          // Split images are listed once, by their first part
+          if (it->is_regular_file(errorCode) && extension == L".iso" &&
+              !xdvdfs::Stream::isContinuationPart(it->path())) {
+            params.images.emplace_back(it->path().wstring());
+          }
+        }
+      } else if (std::filesystem::exists(path, errorCode)) {
+        params.images.emplace_back(path.wstring());
+      } else {
+        std::wcout << "The file " << path.wstring() << " does not exist\n";
+        return false;
+      }
+    }
+
+    if (params.images.empty()) {
+      std::wcout << "Missing iso_file parameter. Use --help to see usage\n";
+      return false;
+    }
+
+    return true;
+  }
+
 private:
   static BOOL WINAPI CtrlHandler(DWORD dwCtrlType) {
     switch (dwCtrlType) {
@@ -232,7 +922,11 @@ private:
     case CTRL_LOGOFF_EVENT:
     case CTRL_SHUTDOWN_EVENT: {
       SetConsoleCtrlHandler(CtrlHandler, FALSE);
-      DokanRemoveMountPoint(ms_singleton->m_params.mountPoint.c_str());
+      if (ms_singleton->m_daemon) {
+        ms_singleton->m_daemon->stop();
+      } else {
+        DokanRemoveMountPoint(ms_singleton->m_params.mountPoint.c_str());
+      }
 
       return TRUE;
     }
@@ -241,7 +935,11 @@ private:
     }
   }
 
-  vfs::Container m_vfsContainer;
+  std::shared_ptr<vfs::Container> m_vfsContainer{
+      std::make_shared<vfs::Container>()};
+  vfs::AccessTrace m_accessTrace;
+  vfs::ContentStore m_contentStore;
+  std::unique_ptr<vfs::Daemon> m_daemon;
   Parameters m_params;
 };
 
@@ -0,0 +1,862 @@
+// Part of xbox-iso-vfs
+
+// Concurrent read stress test for vfs::Container. Every read made through the
+// container is checked byte for byte against a reference read of the same
+// range, made directly from the image file without going through xdvdfs.
+// Runs without Dokan, so it builds on any platform and under ThreadSanitizer
+
+#include "vfs.h"
+#include "vfs_hash.h"
+#include "vfs_resident.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+struct Options {
+  std::filesystem::path imagePath;
+  std::vector<unsigned> threadCounts{1, 2, 4, 8};
+  double seconds{2.0};
+  uint64_t seed{1};
+  bool directIO{false};
+  bool resident{false};
+  bool keepImage{false};
+  uint64_t splitSize{0}; ///< split the synthetic image into parts
+};
+
+// Synthetic image
+
+// Content of every synthetic file is a function of its index and offset, so
+// the reference extraction can itself be checked
+uint8_t syntheticByte(size_t fileIndex, uint64_t offset) {
+  auto value = (fileIndex + 1) * 0x9E3779B97F4A7C15ULL + offset;
+  value ^= value >> 29;
+  value *= 0xBF58476D1CE4E5B9ULL;
+  value ^= value >> 32;
+  return static_cast<uint8_t>(value);
+}
+
+struct SyntheticNode {
+  std::string name;
+  bool directory{false};
+  uint32_t size{0};
+  size_t fileIndex{0};
+  std::vector<SyntheticNode> children;
+
+  uint32_t sector{0};
+  uint32_t tableSize{0};
+};
+
+void putLE(std::vector<char> &buffer, size_t offset, uint64_t value,
+           size_t width) {
+  for (size_t i = 0; i < width; ++i) {
+    buffer[offset + i] = static_cast<char>((value >> (i * 8)) & 0xFF);
+  }
+}
+
+// Directory tables are written as a balanced binary tree of dirents, in
+// pre-order so the root of the tree is the first entry; entries never cross
+// a sector boundary and unused space is 0xFF
+std::vector<char> makeTable(const SyntheticNode &directory) {
+  using xdvdfs::SECTOR_SIZE;
+
+  const auto &children = directory.children;
+
+  // Pre-order of the subtree covering [first, last), with the left and right
+  // subtree roots of each entry
+  std::vector<size_t> order;
+  std::vector<size_t> left(children.size(), SIZE_MAX);
+  std::vector<size_t> right(children.size(), SIZE_MAX);
+
+  auto place = [&](auto &self, size_t first, size_t last) -> size_t {
+    if (first >= last) {
+      return SIZE_MAX;
+    }
+
+    auto middle = first + (last - first) / 2;
+    order.push_back(middle);
+    left[middle] = self(self, first, middle);
+    right[middle] = self(self, middle + 1, last);
+    return middle;
+  };
+  place(place, 0, children.size());
+
+  std::vector<size_t> offsets(children.size());
+  size_t offset = 0;
+  for (auto index : order) {
+    auto length = (xdvdfs::FileEntry::NAME_OFFSET +
+                   children[index].name.size() + 3) &
+                  ~size_t(3);
+    if (offset / SECTOR_SIZE != (offset + length - 1) / SECTOR_SIZE) {
+      offset = (offset / SECTOR_SIZE + 1) * SECTOR_SIZE;
+    }
+    offsets[index] = offset;
+    offset += length;
+  }
+
+  auto tableSize = (offset + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+  std::vector<char> table(tableSize, static_cast<char>(0xFF));
+
+  auto link = [&](size_t index) -> uint64_t {
+    return index == SIZE_MAX ? 0 : offsets[index] / 4;
+  };
+
+  for (size_t i = 0; i < children.size(); ++i) {
+    const auto &child = children[i];
+    auto position = offsets[i];
+
+    putLE(table, position + 0x00, link(left[i]), 2);
+    putLE(table, position + 0x02, link(right[i]), 2);
+    putLE(table, position + 0x04, child.sector, 4);
+    putLE(table, position + 0x08,
+          child.directory ? child.tableSize : child.size, 4);
+    table[position + 0x0C] = static_cast<char>(
+        child.directory ? xdvdfs::FileEntry::FILE_DIRECTORY
+                        : xdvdfs::FileEntry::FILE_NORMAL);
+    table[position + 0x0D] = static_cast<char>(child.name.size());
+    std::memcpy(&table[position + xdvdfs::FileEntry::NAME_OFFSET],
+                child.name.data(), child.name.size());
+  }
+
+  return table;
+}
+
+void assignTableSectors(SyntheticNode &directory, uint32_t &nextSector) {
+  directory.tableSize = static_cast<uint32_t>(makeTable(directory).size());
+  directory.sector = nextSector;
+  nextSector += directory.tableSize / xdvdfs::SECTOR_SIZE;
+
+  for (auto &child : directory.children) {
+    if (child.directory) {
+      assignTableSectors(child, nextSector);
+    }
+  }
+}
+
+void assignFileSectors(SyntheticNode &directory, uint32_t &nextSector) {
+  for (auto &child : directory.children) {
+    if (child.directory) {
+      assignFileSectors(child, nextSector);
+    } else if (child.size > 0) {
+      child.sector = nextSector;
+      nextSector += (child.size + xdvdfs::SECTOR_SIZE - 1) /
+                    xdvdfs::SECTOR_SIZE;
+    }
+  }
+}
+
+bool writeNode(std::ofstream &output, const SyntheticNode &directory) {
+  auto table = makeTable(directory);
+  output.seekp(static_cast<std::streamoff>(directory.sector) *
+               xdvdfs::SECTOR_SIZE);
+  output.write(table.data(), static_cast<std::streamsize>(table.size()));
+
+  for (const auto &child : directory.children) {
+    if (child.directory) {
+      writeNode(output, child);
+      continue;
+    }
+
+    std::vector<char> data(child.size);
+    for (uint32_t i = 0; i < child.size; ++i) {
+      data[i] = static_cast<char>(syntheticByte(child.fileIndex, i));
+    }
+
+    output.seekp(static_cast<std::streamoff>(child.sector) *
+                 xdvdfs::SECTOR_SIZE);
+    output.write(data.data(), static_cast<std::streamsize>(data.size()));
+  }
+
+  return output.good();
+}
+
+// File names are unique, and map to the index the content was generated from
+using SyntheticFiles = std::map<std::string, size_t>;
+
+// Files sit on and either side of sector and buffer boundaries
+bool writeSyntheticImage(const std::filesystem::path &path,
+                         SyntheticFiles &files) {
+  const uint32_t sizes[] = {0,     1,     2047,   2048,   2049,  4095,
+                            4096,  4097,  65535,  65536,  65537, 131071,
+                            300001, 1048576, 1048577, 3145739};
+
+  size_t fileIndex = 0;
+  auto addFiles = [&](SyntheticNode &directory, const std::string &prefix) {
+    for (auto size : sizes) {
+      SyntheticNode file;
+      file.name = prefix + std::to_string(size) + ".bin";
+      file.size = size;
+      file.fileIndex = fileIndex++;
+      files.emplace(file.name, file.fileIndex);
+      directory.children.push_back(file);
+    }
+  };
+
+  SyntheticNode root;
+  root.directory = true;
+  addFiles(root, "root_");
+
+  for (int i = 0; i < 4; ++i) {
+    SyntheticNode folder;
+    folder.name = "Folder" + std::to_string(i);
+    folder.directory = true;
+    addFiles(folder, "f" + std::to_string(i) + "_");
+
+    SyntheticNode nested;
+    nested.name = "Nested";
+    nested.directory = true;
+    addFiles(nested, "n" + std::to_string(i) + "_");
+    folder.children.push_back(nested);
+
+    root.children.push_back(folder);
+  }
+
+  // Enough names to spill the root table over several sectors
+  for (int i = 0; i < 150; ++i) {
+    SyntheticNode file;
+    file.name = "padding_entry_with_a_long_name_" + std::to_string(i) + ".dat";
+    file.size = static_cast<uint32_t>(i * 37);
+    file.fileIndex = fileIndex++;
+    files.emplace(file.name, file.fileIndex);
+    root.children.push_back(file);
+  }
+
+  uint32_t nextSector = xdvdfs::VOLUME_DESCRIPTOR_SECTOR + 1;
+  assignTableSectors(root, nextSector);
+  assignFileSectors(root, nextSector);
+
+  std::ofstream output(path, std::ofstream::binary | std::ofstream::trunc);
+  if (!output.is_open()) {
+    return false;
+  }
+
+  std::vector<char> descriptor(xdvdfs::SECTOR_SIZE, 0);
+  std::memcpy(descriptor.data(), xdvdfs::MAGIC_ID, 0x14);
+  putLE(descriptor, 0x14, root.sector, 4);
+  putLE(descriptor, 0x18, root.tableSize, 4);
+  putLE(descriptor, 0x1C, 0x01D0000000000000ULL, 8);
+  std::memcpy(descriptor.data() + 0x7EC, xdvdfs::MAGIC_ID, 0x14);
+
+  output.seekp(xdvdfs::VOLUME_DESCRIPTOR_SECTOR * xdvdfs::SECTOR_SIZE);
+  output.write(descriptor.data(), descriptor.size());
+
+  if (!writeNode(output, root)) {
+    return false;
+  }
+
+  // Pad the final sector
+  output.seekp(static_cast<std::streamoff>(nextSector) * xdvdfs::SECTOR_SIZE -
+               1);
+  output.put('\0');
+
+  return output.good();
+}
+
+// Reference
+
+struct ReferenceFile {
+  vfs::Container::EntryHandle handle;
+  uint64_t imageOffset; ///< absolute offset of the data in the image file
+  uint32_t size;
+  vfs::ContentHash hash;
+};
+
+struct ReferenceListing {
+  std::string path;
+  std::vector<vfs::Container::EntryHandle> children;
+};
+
+struct Reference {
+  std::vector<ReferenceFile> files;
+  std::vector<ReferenceListing> listings;
+};
+
+// Reads the image files with plain stream I/O, independent of xdvdfs::Stream
+class ReferenceReader {
+public:
+  explicit ReferenceReader(const std::vector<std::filesystem::path> &paths) {
+    for (const auto &path : paths) {
+      std::error_code errorCode;
+      m_sizes.push_back(std::filesystem::file_size(path, errorCode));
+      m_files.emplace_back(path, std::ifstream::binary | std::ifstream::in);
+    }
+  }
+
+  bool isOpen() const {
+    return !m_files.empty() &&
+           std::all_of(m_files.begin(), m_files.end(),
+                       [](const std::ifstream &file) { return file.is_open(); });
+  }
+
+  uint32_t read(const ReferenceFile &file, char *buffer, uint32_t length,
+                uint64_t offset) {
+    if (offset >= file.size) {
+      return 0;
+    }
+
+    auto expected =
+        static_cast<uint32_t>(std::min<uint64_t>(length, file.size - offset));
+
+    // Walk the parts in order
+    auto position = file.imageOffset + offset;
+    uint32_t done = 0;
+    for (size_t i = 0; i < m_files.size() && done < expected; ++i) {
+      if (position >= m_sizes[i]) {
+        position -= m_sizes[i];
+        continue;
+      }
+
+      auto length = static_cast<uint32_t>(
+          std::min<uint64_t>(expected - done, m_sizes[i] - position));
+
+      m_files[i].clear();
+      m_files[i].seekg(static_cast<std::streamoff>(position));
+      m_files[i].read(buffer + done, length);
+      done += static_cast<uint32_t>(m_files[i].gcount());
+
+      position = 0;
+    }
+
+    return done;
+  }
+
+private:
+  std::vector<std::ifstream> m_files;
+  std::vector<uint64_t> m_sizes;
+};
+
+// Splits the image into parts of splitSize bytes, named as split images are
+std::vector<std::filesystem::path>
+splitImage(const std::filesystem::path &path, uint64_t splitSize) {
+  std::vector<std::filesystem::path> parts;
+
+  std::ifstream input(path, std::ifstream::binary | std::ifstream::in);
+  std::vector<char> buffer(static_cast<size_t>(splitSize));
+
+  while (input) {
+    input.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    if (input.gcount() == 0) {
+      break;
+    }
+
+    auto part = path.parent_path() / path.stem();
+    part += "." + std::to_string(parts.size() + 1);
+    part += path.extension();
+
+    std::ofstream output(part, std::ofstream::binary | std::ofstream::trunc);
+    output.write(buffer.data(), input.gcount());
+    parts.emplace_back(part);
+  }
+
+  return parts;
+}
+
+bool buildReference(const vfs::Container &container,
+                    const std::vector<std::filesystem::path> &imagePaths,
+                    const SyntheticFiles &synthetic, Reference &reference) {
+  ReferenceReader reader(imagePaths);
+  if (!reader.isOpen()) {
+    return false;
+  }
+
+  auto partitionOffset =
+      static_cast<uint64_t>(container.getFileStream()->m_offset);
+
+  std::vector<char> data;
+  for (size_t handle = 0; handle < container.getEntryCount(); ++handle) {
+    auto entry = container.getEntry(handle);
+
+    if (entry->isDirectory()) {
+      ReferenceListing listing;
+      listing.path = container.getPath(handle);
+      listing.children = container.getFolderList(listing.path);
+      reference.listings.push_back(std::move(listing));
+      continue;
+    }
+
+    ReferenceFile file;
+    file.handle = handle;
+    file.imageOffset = partitionOffset + static_cast<uint64_t>(
+                                             entry->getStartSector()) *
+                                             xdvdfs::SECTOR_SIZE;
+    file.size = entry->getFileSize();
+
+    data.resize(file.size);
+    if (reader.read(file, data.data(), file.size, 0) != file.size) {
+      std::cout << "Reference extraction failed for "
+                << container.getPath(handle) << "\n";
+      return false;
+    }
+
+    // Check the extraction itself against what the generator wrote
+    auto it = synthetic.find(entry->getFilename());
+    if (it != synthetic.end()) {
+      std::vector<char> expected(file.size);
+      auto index = it->second;
+      for (uint32_t i = 0; i < file.size; ++i) {
+        expected[i] = static_cast<char>(syntheticByte(index, i));
+      }
+      if (expected != data) {
+        std::cout << "Reference extraction of " << container.getPath(handle)
+                  << " does not match the synthetic image\n";
+        return false;
+      }
+    }
+
+    vfs::Sha256 sha;
+    sha.update(data.data(), data.size());
+    file.hash = sha.finish();
+
+    reference.files.push_back(file);
+  }
+
+  return !reference.files.empty();
+}
+
+// Workload
+
+struct Failures {
+  std::mutex mutex;
+  std::atomic<uint64_t> count{0};
+
+  void report(const std::string &message) {
+    if (count++ < 20) {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::cout << "  FAIL " << message << "\n";
+    }
+  }
+};
+
+// Time in the container and time checking its results are kept apart, so
+// the rates reflect Container alone
+struct Counters {
+  uint64_t reads{0};
+  uint64_t bytes{0};
+  uint64_t listings{0};
+  double readSeconds{0.0};
+  double listingSeconds{0.0};
+  double verifySeconds{0.0}; ///< reference reads and comparisons
+};
+
+using Clock = std::chrono::steady_clock;
+
+double secondsSince(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+class Worker {
+public:
+  Worker(const vfs::Container &container, const Reference &reference,
+         const std::vector<std::filesystem::path> &imagePaths,
+         Failures &failures, uint64_t seed)
+      : m_container(container), m_reference(reference), m_reader(imagePaths),
+        m_failures(failures), m_random(seed) {}
+
+  void run(const std::atomic<bool> &stop) {
+    std::uniform_int_distribution<int> operation(0, 99);
+
+    while (!stop.load(std::memory_order_relaxed)) {
+      auto choice = operation(m_random);
+      if (choice < 70) {
+        randomRead();
+      } else if (choice < 90) {
+        boundaryRead();
+      } else {
+        listing();
+      }
+    }
+  }
+
+  // Reads every file in random sized chunks and compares the hash
+  void verifyWholeFiles(size_t first, size_t step) {
+    std::uniform_int_distribution<uint32_t> chunkSize(1, 256 * 1024);
+    std::vector<char> buffer;
+
+    for (size_t i = first; i < m_reference.files.size(); i += step) {
+      const auto &file = m_reference.files[i];
+      vfs::Sha256 sha;
+
+      uint64_t offset = 0;
+      while (offset < file.size) {
+        buffer.resize(chunkSize(m_random));
+        auto length = m_container.readEntry(file.handle, buffer.data(),
+                                            static_cast<uint32_t>(
+                                                buffer.size()),
+                                            static_cast<int64_t>(offset));
+        if (length == 0) {
+          break;
+        }
+
+        sha.update(buffer.data(), length);
+        offset += length;
+      }
+
+      if (offset != file.size || sha.finish() != file.hash) {
+        m_failures.report("whole file " + m_container.getPath(file.handle));
+      }
+    }
+  }
+
+  const Counters &getCounters() const { return m_counters; }
+
+private:
+  const ReferenceFile &pickFile() {
+    std::uniform_int_distribution<size_t> index(0,
+                                                m_reference.files.size() - 1);
+    return m_reference.files[index(m_random)];
+  }
+
+  void randomRead() {
+    const auto &file = pickFile();
+
+    std::uniform_int_distribution<uint64_t> offset(0, file.size + 64);
+    std::uniform_int_distribution<uint32_t> length(1, 256 * 1024);
+
+    check(file, offset(m_random), length(m_random));
+  }
+
+  // End of file, sector edges and offsets which do not fit in 32 bits
+  void boundaryRead() {
+    const auto &file = pickFile();
+
+    std::uniform_int_distribution<int> kind(0, 3);
+    std::uniform_int_distribution<uint32_t> small(1, 4096);
+
+    uint64_t offset = 0;
+    switch (kind(m_random)) {
+    case 0:
+      offset = file.size - std::min<uint64_t>(file.size, small(m_random));
+      break;
+    case 1: {
+      std::uniform_int_distribution<uint64_t> sector(
+          0, file.size / xdvdfs::SECTOR_SIZE);
+      offset = sector(m_random) * xdvdfs::SECTOR_SIZE;
+      offset -= std::min<uint64_t>(offset, small(m_random) % 2);
+      break;
+    }
+    case 2:
+      offset = file.size;
+      break;
+    default:
+      offset = (uint64_t(1) << 32) + small(m_random);
+      break;
+    }
+
+    check(file, offset, small(m_random));
+  }
+
+  void check(const ReferenceFile &file, uint64_t offset, uint32_t length) {
+    m_actual.assign(length, 0);
+    m_expected.assign(length, 0);
+
+    auto start = Clock::now();
+    auto actualLength = m_container.readEntry(
+        file.handle, m_actual.data(), length, static_cast<int64_t>(offset));
+    m_counters.readSeconds += secondsSince(start);
+
+    ++m_counters.reads;
+    m_counters.bytes += actualLength;
+
+    start = Clock::now();
+    auto expectedLength =
+        m_reader.read(file, m_expected.data(), length, offset);
+    auto matches =
+        actualLength == expectedLength &&
+        std::memcmp(m_actual.data(), m_expected.data(), expectedLength) == 0;
+    m_counters.verifySeconds += secondsSince(start);
+
+    if (!matches) {
+      std::ostringstream message;
+      message << m_container.getPath(file.handle) << " offset " << offset
+              << " length " << length << ": read " << actualLength
+              << " expected " << expectedLength;
+      m_failures.report(message.str());
+    }
+  }
+
+  // Pages through a directory and checks it against the reference listing
+  void listing() {
+    std::uniform_int_distribution<size_t> index(
+        0, m_reference.listings.size() - 1);
+    std::uniform_int_distribution<size_t> pageSize(1, 64);
+
+    const auto &expected = m_reference.listings[index(m_random)];
+    auto maxRecords = pageSize(m_random);
+
+    auto start = Clock::now();
+
+    std::vector<vfs::Container::EntryHandle> children;
+    size_t cursor = 0;
+    for (;;) {
+      auto page = m_container.getListing(expected.path, cursor, maxRecords);
+      for (size_t i = 0; i < page.count; ++i) {
+        const auto &record = page.records[i];
+        children.push_back(record.handle);
+
+        auto entry = m_container.getEntry(record.handle);
+        if (record.fileSize != entry->getFileSize() ||
+            record.nameLength != entry->getFilename().size()) {
+          m_failures.report("listing record " +
+                            m_container.getPath(record.handle));
+        }
+      }
+
+      if (page.complete) {
+        break;
+      }
+      cursor = page.next;
+    }
+
+    ++m_counters.listings;
+    m_counters.listingSeconds += secondsSince(start);
+
+    if (children != expected.children) {
+      m_failures.report("listing " + expected.path);
+      return;
+    }
+
+    // Path lookup must round trip
+    for (auto child : children) {
+      if (m_container.getHandle(m_container.getPath(child)) != child) {
+        m_failures.report("lookup " + m_container.getPath(child));
+      }
+    }
+  }
+
+  const vfs::Container &m_container;
+  const Reference &m_reference;
+  ReferenceReader m_reader;
+  Failures &m_failures;
+  std::mt19937_64 m_random;
+
+  std::vector<char> m_actual;
+  std::vector<char> m_expected;
+  Counters m_counters;
+};
+
+bool readOptions(Options &options, int argc, char **argv) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+
+    if (arg == "--threads" && i + 1 < argc) {
+      options.threadCounts.clear();
+      std::istringstream list(argv[++i]);
+      std::string count;
+      while (std::getline(list, count, ',')) {
+        options.threadCounts.push_back(
+            std::max(1, std::atoi(count.c_str())));
+      }
+    } else if (arg == "--seconds" && i + 1 < argc) {
+      options.seconds = std::atof(argv[++i]);
+    } else if (arg == "--seed" && i + 1 < argc) {
+      options.seed = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--direct") {
+      options.directIO = true;
+    } else if (arg == "--resident") {
+      options.resident = true;
+    } else if (arg == "--split" && i + 1 < argc) {
+      options.splitSize = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--keep") {
+      options.keepImage = true;
+    } else if (!arg.empty() && arg[0] != '-' && options.imagePath.empty()) {
+      options.imagePath = arg;
+    } else {
+      std::cout << "xbox-iso-vfs-stress [--threads 1,2,4,8] [--seconds 2] "
+                   "[--seed 1] [--direct]\n"
+                   "                    [--resident] [--split <bytes>] [--keep] "
+                   "[iso_file]\n"
+                   "  Without an iso_file a synthetic image is generated, "
+                   "optionally split\n"
+                   "  into parts of <bytes>\n";
+      return false;
+    }
+  }
+
+  return !options.threadCounts.empty();
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  Options options;
+  if (!readOptions(options, argc, argv)) {
+    return 2;
+  }
+
+  SyntheticFiles synthetic;
+  std::vector<std::filesystem::path> generatedFiles;
+  if (options.imagePath.empty()) {
+    options.imagePath =
+        std::filesystem::temp_directory_path() / "xbox-iso-vfs-stress.iso";
+    if (!writeSyntheticImage(options.imagePath, synthetic)) {
+      std::cout << "Failed to write " << options.imagePath << "\n";
+      return 1;
+    }
+
+    generatedFiles.push_back(options.imagePath);
+
+    // Deliberately not sector aligned, so reads span the parts
+    if (options.splitSize > 0) {
+      auto parts = splitImage(options.imagePath, options.splitSize);
+      if (parts.empty()) {
+        return 1;
+      }
+
+      generatedFiles.insert(generatedFiles.end(), parts.begin(), parts.end());
+      options.imagePath = parts.front();
+    }
+  }
+
+  vfs::Container container;
+  if (container.setup(options.imagePath, options.directIO) !=
+      vfs::SetupState::Success) {
+    std::cout << "Failed to read " << options.imagePath << "\n";
+    return 1;
+  }
+
+  auto imagePaths = xdvdfs::Stream::findParts(options.imagePath);
+
+  Reference reference;
+  if (!buildReference(container, imagePaths, synthetic, reference)) {
+    std::cout << "Failed to build the reference extraction\n";
+    return 1;
+  }
+
+  if (options.resident) {
+    auto report = vfs::makeResident(container, {});
+    if (!report.success) {
+      std::cout << "Failed to make the image resident\n";
+      return 1;
+    }
+  }
+
+  std::cout << "Image " << options.imagePath << " (" << imagePaths.size()
+            << (imagePaths.size() == 1 ? " part" : " parts") << "): "
+            << reference.files.size() << " files, "
+            << reference.listings.size() << " directories"
+            << (container.getFileStream()->isDirectUnsupported()
+                    ? ", direct I/O unsupported on this volume"
+                    : options.directIO ? ", direct I/O" : "")
+            << (options.resident ? ", resident" : "") << "\n";
+
+  Failures failures;
+
+  // Every file once, split across the largest thread count
+  {
+    auto threadCount = *std::max_element(options.threadCounts.begin(),
+                                         options.threadCounts.end());
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < threadCount; ++i) {
+      workers.push_back(std::make_unique<Worker>(
+          container, reference, imagePaths, failures,
+          options.seed + i));
+    }
+    for (unsigned i = 0; i < threadCount; ++i) {
+      threads.emplace_back(
+          [&, i]() { workers[i]->verifyWholeFiles(i, threadCount); });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+
+    std::cout << "Whole file verification: "
+              << (failures.count ? "FAILED" : "ok") << "\n";
+  }
+
+  std::cout << std::setw(8) << "threads" << std::setw(12) << "reads"
+            << std::setw(12) << "MiB/s" << std::setw(12) << "reads/s"
+            << std::setw(12) << "listings/s" << std::setw(10) << "verify"
+            << std::setw(10) << "scaling" << "\n";
+
+  double baseline = 0.0;
+  for (auto threadCount : options.threadCounts) {
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (unsigned i = 0; i < threadCount; ++i) {
+      workers.push_back(std::make_unique<Worker>(
+          container, reference, imagePaths, failures,
+          options.seed * 1000 + threadCount * 100 + i));
+    }
+
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> threads;
+
+    auto startTime = Clock::now();
+    for (auto &worker : workers) {
+      threads.emplace_back([&worker, &stop]() { worker->run(stop); });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(options.seconds));
+    stop = true;
+
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    std::chrono::duration<double> elapsed = Clock::now() - startTime;
+
+    // Each thread's rate over its own time in the container, summed; waits
+    // on locks inside the container lengthen that time and show up here
+    uint64_t reads = 0;
+    double throughput = 0.0;
+    double readRate = 0.0;
+    double listingRate = 0.0;
+    double verifySeconds = 0.0;
+
+    for (const auto &worker : workers) {
+      const auto &counters = worker->getCounters();
+
+      reads += counters.reads;
+      if (counters.readSeconds > 0.0) {
+        throughput += counters.bytes / (1024.0 * 1024.0) / counters.readSeconds;
+        readRate += counters.reads / counters.readSeconds;
+      }
+      if (counters.listingSeconds > 0.0) {
+        listingRate += counters.listings / counters.listingSeconds;
+      }
+      verifySeconds += counters.verifySeconds;
+    }
+
+    if (baseline == 0.0) {
+      baseline = throughput;
+    }
+
+    // Share of the workers' time spent checking results
+    auto verifyShare = 100.0 * verifySeconds / (elapsed.count() * threadCount);
+
+    std::cout << std::fixed << std::setprecision(1) << std::setw(8)
+              << threadCount << std::setw(12) << reads << std::setw(12)
+              << throughput << std::setw(12) << readRate << std::setw(12)
+              << listingRate << std::setw(9) << verifyShare << "%"
+              << std::setw(9)
+              << (baseline > 0.0 ? throughput / baseline : 0.0) << "x\n";
+  }
+
+  if (!options.keepImage) {
+    for (const auto &path : generatedFiles) {
+      std::error_code errorCode;
+      std::filesystem::remove(path, errorCode);
+    }
+  }
+
+  if (failures.count) {
+    std::cout << failures.count << " verification failures\n";
+    return 1;
+  }
+
+  std::cout << "All reads verified\n";
+  return 0;
+}
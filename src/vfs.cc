@@ -1,28 +1,139 @@
 // Part of xbox-iso-vfs
 
 #include "vfs.h"
+#include "vfs_store.h"
 
 #include <algorithm>
+#include <iterator>
+#include <numeric>
+#include <string>
 
 namespace vfs {
-SetupState Container::setup(const std::wstring &filename) {
+namespace {
+// Grows a column to hold at least the needed elements, at least doubling so
+// repeated reservations stay amortized
+template <class Column> void reserveColumn(Column &column, size_t needed) {
+  if (needed > column.capacity()) {
+    column.reserve(std::max(needed, column.capacity() * 2));
+  }
+}
+
+// Enforce case-insensitive name resolution
+char foldChar(char c) {
+  return static_cast<char>(::tolower(static_cast<unsigned char>(c)));
+}
+
+void appendFolded(std::string &column, const std::string &text) {
+  for (auto c : text) {
+    column += foldChar(c);
+  }
+}
+} // namespace
+
+#ifdef _WIN32
+std::wstring toWideString(const std::filesystem::path &path) {
+  return path.native();
+}
+
+std::filesystem::path fromWideString(const std::wstring &text) {
+  return std::filesystem::path(text);
+}
+#else
+std::wstring toWideString(const std::filesystem::path &path) {
+  constexpr static wchar_t sc_replacement = 0xFFFD;
+
+  const auto &text = path.native();
+  std::wstring result;
+  result.reserve(text.size());
+
+  for (size_t i = 0; i < text.size();) {
+    auto lead = static_cast<uint8_t>(text[i]);
+
+    size_t length = lead < 0x80             ? 1
+                    : (lead & 0xE0) == 0xC0 ? 2
+                    : (lead & 0xF0) == 0xE0 ? 3
+                    : (lead & 0xF8) == 0xF0 ? 4
+                                            : 0;
+
+    uint32_t codePoint = length == 1 ? lead : lead & (0x7F >> length);
+    bool valid = length > 0 && i + length <= text.size();
+
+    for (size_t j = 1; valid && j < length; ++j) {
+      auto next = static_cast<uint8_t>(text[i + j]);
+      valid = (next & 0xC0) == 0x80;
+      codePoint = (codePoint << 6) | (next & 0x3F);
+    }
+
+    // Overlong forms and surrogates are rejected as well
+    constexpr static uint32_t sc_minimum[] = {0, 0, 0x80, 0x800, 0x10000};
+    valid = valid && codePoint >= sc_minimum[length] &&
+            codePoint <= 0x10FFFF && (codePoint < 0xD800 || codePoint > 0xDFFF);
+
+    result += valid ? static_cast<wchar_t>(codePoint) : sc_replacement;
+    i += valid ? length : 1;
+  }
+
+  return result;
+}
+
+std::filesystem::path fromWideString(const std::wstring &text) {
+  std::string result;
+  result.reserve(text.size());
+
+  for (auto c : text) {
+    auto codePoint = static_cast<uint32_t>(c);
+    if (codePoint > 0x10FFFF || (codePoint >= 0xD800 && codePoint <= 0xDFFF)) {
+      codePoint = 0xFFFD;
+    }
+
+    if (codePoint < 0x80) {
+      result += static_cast<char>(codePoint);
+    } else if (codePoint < 0x800) {
+      result += static_cast<char>(0xC0 | (codePoint >> 6));
+      result += static_cast<char>(0x80 | (codePoint & 0x3F));
+    } else if (codePoint < 0x10000) {
+      result += static_cast<char>(0xE0 | (codePoint >> 12));
+      result += static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+      result += static_cast<char>(0x80 | (codePoint & 0x3F));
+    } else {
+      result += static_cast<char>(0xF0 | (codePoint >> 18));
+      result += static_cast<char>(0x80 | ((codePoint >> 12) & 0x3F));
+      result += static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+      result += static_cast<char>(0x80 | (codePoint & 0x3F));
+    }
+  }
+
+  return std::filesystem::path(result);
+}
+#endif
+
+Container::~Container() {
+  MemoryGovernor::getDefault().removeConsumer(m_memoryId);
+}
+
+SetupState Container::setup(const std::filesystem::path &filename,
+                            bool directIO) {
   auto stream = std::make_unique<xdvdfs::Stream>();
 
-  stream->m_file.open(filename.c_str(),
-                      std::ifstream::binary | std::ifstream::in);
-  if (!stream->m_file.is_open()) {
+  // Split images are opened from any of their parts
+  if (!stream->open(xdvdfs::Stream::findParts(filename), directIO)) {
     return SetupState::ErrorFile;
   }
 
+  // Cache file size of the input file
+  auto volumeSize = stream->getSize();
+
+  return setupFromStream(std::move(stream), filename, volumeSize);
+}
+
+SetupState Container::setupFromStream(std::unique_ptr<xdvdfs::Stream> stream,
+                                      const std::filesystem::path &path,
+                                      uint64_t volumeSize) {
   xdvdfs::VolumeDescriptor vd;
   vd.readFromFile(*stream);
 
   if (!vd.validate()) {
-    // Some "dual layer" ISO files will have both a video and game partition
-    constexpr static size_t sc_gamePartitionOffset =
-        xdvdfs::SECTOR_SIZE * 32 * 6192;
-
-    stream->m_offset = sc_gamePartitionOffset;
+    stream->m_offset = xdvdfs::GAME_PARTITION_OFFSET;
 
     vd.readFromFile(*stream);
 
@@ -31,21 +142,26 @@ SetupState Container::setup(const std::wstring &filename) {
     }
   }
 
-  xdvdfs::FileEntry de = vd.getRootDirEntry(*stream);
-  build(*stream, de);
+  build(*stream, vd);
 
   // Cache creation time on volume descriptor (shared between all sub files and
   // folders)
   m_volumeModified = vd.getCreationTime();
+  m_volumeDescriptor = vd;
 
-  // Cache file size of the input file
-  stream->m_file.seekg(0, std::ifstream::end);
-  m_volumeSize = static_cast<uint64_t>(stream->m_file.tellg());
+  buildListings();
+  buildPathIndex();
+  buildSectorMap();
+
+  m_volumeSize = volumeSize;
 
   // Promote local variable
   std::swap(stream, m_stream);
 
-  m_name = std::filesystem::path(filename).replace_extension("").filename();
+  m_name = toWideString(path.stem());
+  m_path = path;
+
+  chargeIndexMemory();
 
   return SetupState::Success;
 }
@@ -68,55 +184,336 @@ const xdvdfs::FileEntry *Container::getEntry(EntryHandle handle) const {
   return nullptr;
 }
 
+uint32_t Container::readEntry(EntryHandle handle, void *buffer,
+                              uint32_t bufferlength, int64_t offset) const {
+  auto entry = getEntry(handle);
+  if (!entry || entry->isDirectory()) {
+    return 0;
+  }
+
+  uint32_t length;
+  if (m_contentStore) {
+    length = m_contentStore->read(m_contentHashes[handle],
+                                  entry->getFileSize(), buffer, bufferlength,
+                                  offset);
+  } else {
+    length = entry->read(*m_stream, buffer, bufferlength, offset);
+  }
+
+  m_readCount.fetch_add(1, std::memory_order_relaxed);
+  m_readBytes.fetch_add(length, std::memory_order_relaxed);
+
+  return length;
+}
+
 Container::FileResults
 Container::getFolderList(const std::filesystem::path &path) const {
   FileResults results;
 
-  auto handle = getHandle(path);
-  for (size_t i = 0; i < m_parentHandles.size(); ++i) {
-    if (m_parentHandles[i] == handle) {
-      results.emplace_back(i);
-    }
+  auto listing = getListing(path);
+  for (size_t i = 0; i < listing.count; ++i) {
+    results.emplace_back(listing.records[i].handle);
   }
 
   return results;
 }
 
-void Container::build(xdvdfs::Stream &file, xdvdfs::FileEntry &dirent) {
-  xdvdfs::FileEntry root("\\");
-  auto newHandle = registerFileEntry(root, sc_invalidHandle);
+ListingPage Container::getListing(const std::filesystem::path &path,
+                                  size_t cursor, size_t maxRecords) const {
+  return getListing(getHandle(path), cursor, maxRecords);
+}
+
+ListingPage Container::getListing(EntryHandle handle, size_t cursor,
+                                  size_t maxRecords) const {
+  ListingPage page;
+
+  if (handle >= m_entries.size()) {
+    return page;
+  }
+
+  auto first = m_listingOffsets[handle];
+  auto total = m_listingOffsets[handle + 1] - first;
+
+  cursor = std::min(cursor, total);
+
+  page.records = m_listingRecords.data() + first + cursor;
+  page.count = std::min(maxRecords, total - cursor);
+  page.next = cursor + page.count;
+  page.complete = (page.next == total);
+
+  return page;
+}
+
+void Container::buildListings() {
+  // Counting sort of every entry by parent handle, which keeps the children
+  // of each directory in index order
+  m_listingOffsets.assign(m_entries.size() + 1, 0);
+
+  for (auto parent : m_parentHandles) {
+    if (parent != sc_invalidHandle) {
+      ++m_listingOffsets[parent + 1];
+    }
+  }
+
+  for (size_t i = 1; i < m_listingOffsets.size(); ++i) {
+    m_listingOffsets[i] += m_listingOffsets[i - 1];
+  }
+
+  auto cursors = m_listingOffsets;
+
+  m_listingRecords.resize(m_listingOffsets.back());
+  m_listingNames.clear();
+
+  for (size_t i = 0; i < m_entries.size(); ++i) {
+    auto parent = m_parentHandles[i];
+    if (parent == sc_invalidHandle) {
+      continue;
+    }
+
+    const auto &entry = m_entries[i];
+    const auto &name = entry.getFilename();
 
-  buildFromTreeRecursive(file, dirent, newHandle);
+    auto &record = m_listingRecords[cursors[parent]++];
+    record.handle = i;
+    record.nameOffset = m_listingNames.size();
+    record.nameLength = static_cast<uint16_t>(name.size());
+    record.attributes = xdvdfs::FileEntry::FILE_READONLY;
+    if (entry.isDirectory()) {
+      record.attributes |= xdvdfs::FileEntry::FILE_DIRECTORY;
+    }
+    record.fileSize = entry.getFileSize();
+    record.modified = m_volumeModified;
+
+    m_listingNames.append(name.begin(), name.end());
+    m_listingNames.push_back(L'\0');
+  }
 }
 
-void Container::buildFromTreeRecursive(xdvdfs::Stream &file,
-                                       xdvdfs::FileEntry &dirent,
-                                       EntryHandle parent) {
-  auto newHandle = registerFileEntry(dirent, parent);
+void Container::buildPathIndex() {
+  m_pathIndex.resize(m_entries.size());
+  std::iota(m_pathIndex.begin(), m_pathIndex.end(), EntryHandle(0));
+
+  // Stable, so the first of any entries sharing a path is the one found
+  std::stable_sort(m_pathIndex.begin(), m_pathIndex.end(),
+                   [this](EntryHandle left, EntryHandle right) {
+                     return getFoldedPath(left) < getFoldedPath(right);
+                   });
+}
+
+void Container::buildSectorMap() {
+  auto sectorCount = [](uint64_t size) {
+    return static_cast<uint32_t>((size + xdvdfs::SECTOR_SIZE - 1) /
+                                 xdvdfs::SECTOR_SIZE);
+  };
+
+  m_sectorExtents.clear();
+
+  // Reserved area and volume descriptor
+  m_sectorExtents.push_back(
+      {0, xdvdfs::VOLUME_DESCRIPTOR_SECTOR + 1, sc_invalidHandle});
+
+  // The root directory is not a dirent; its table is found from the
+  // descriptor
+  const auto &vd = m_volumeDescriptor;
+  m_sectorExtents.push_back({vd.getRootDirTableSector(),
+                             sectorCount(vd.getRootDirTableSize()), 0});
 
-  if (dirent.isDirectory()) {
-    xdvdfs::FileEntry entry = dirent.getFirstEntry(file);
-    if (entry.validate()) {
-      buildFromTreeRecursive(file, entry, newHandle);
+  for (size_t handle = 1; handle < m_entries.size(); ++handle) {
+    const auto &entry = m_entries[handle];
+    if (entry.getFileSize() == 0) {
+      continue;
     }
+
+    m_sectorExtents.push_back(
+        {entry.getStartSector(), sectorCount(entry.getFileSize()), handle});
+  }
+
+  // Extents sharing a start are ordered longest first, so the innermost
+  // extent holding a sector is always the last one found by getEntryAtSector
+  std::sort(m_sectorExtents.begin(), m_sectorExtents.end(),
+            [](const SectorExtent &a, const SectorExtent &b) {
+              if (a.sector != b.sector) {
+                return a.sector < b.sector;
+              }
+              if (a.count != b.count) {
+                return a.count > b.count;
+              }
+              return a.handle > b.handle;
+            });
+
+  m_usedSectors.clear();
+  for (const auto &extent : m_sectorExtents) {
+    auto end = static_cast<uint64_t>(extent.sector) + extent.count;
+
+    if (!m_usedSectors.empty()) {
+      auto &last = m_usedSectors.back();
+      auto lastEnd = static_cast<uint64_t>(last.sector) + last.count;
+
+      if (extent.sector <= lastEnd) {
+        last.count =
+            static_cast<uint32_t>(std::max(lastEnd, end) - last.sector);
+        continue;
+      }
+    }
+
+    m_usedSectors.push_back({extent.sector, extent.count, sc_invalidHandle});
+  }
+}
+
+uint64_t Container::getIndexSize() const {
+  uint64_t size = m_entries.capacity() * sizeof(xdvdfs::FileEntry) +
+                  (m_parentHandles.capacity() + m_pathIndex.capacity()) *
+                      sizeof(EntryHandle);
+
+  size += m_foldedNames.capacity() + m_foldedPaths.capacity() +
+          (m_foldedNameOffsets.capacity() + m_foldedPathOffsets.capacity() +
+           m_listingOffsets.capacity()) *
+              sizeof(size_t);
+  size += m_listingRecords.capacity() * sizeof(ListingRecord) +
+          m_listingNames.capacity() * sizeof(wchar_t);
+  size += (m_sectorExtents.capacity() + m_usedSectors.capacity()) *
+          sizeof(SectorExtent);
+  size += m_contentHashes.capacity() * sizeof(ContentHash);
+
+  return size;
+}
+
+void Container::chargeIndexMemory() {
+  // Accounting only; an index in use cannot be dropped from under its mount
+  auto &governor = MemoryGovernor::getDefault();
+  if (m_memoryId == 0) {
+    m_memoryId = governor.addConsumer(MemoryCategory::Index);
   }
 
-  if (dirent.hasLeftChild()) {
-    xdvdfs::FileEntry entry = dirent.getLeftChild(file);
+  governor.setUsage(m_memoryId, getIndexSize());
+}
+
+Container::EntryHandle Container::getEntryAtSector(uint32_t sector) const {
+  auto startsAfter = [](uint32_t value, const SectorExtent &extent) {
+    return value < extent.sector;
+  };
+
+  // Padding is answered from the merged runs, so the walk below always ends
+  // within the run holding the sector
+  auto run = std::upper_bound(m_usedSectors.begin(), m_usedSectors.end(),
+                              sector, startsAfter);
+  if (run == m_usedSectors.begin() ||
+      sector - std::prev(run)->sector >= std::prev(run)->count) {
+    return sc_invalidHandle;
+  }
 
-    if (entry.validate()) {
-      buildFromTreeRecursive(file, entry, parent);
+  // Extents may nest or overlap in a malformed image, so walk back from the
+  // last one starting at or before the sector to the first holding it
+  auto it = std::upper_bound(m_sectorExtents.begin(), m_sectorExtents.end(),
+                             sector, startsAfter);
+  while (it != m_sectorExtents.begin()) {
+    --it;
+    if (sector - it->sector < it->count) {
+      return it->handle;
     }
   }
 
-  if (dirent.hasRightChild()) {
-    xdvdfs::FileEntry entry = dirent.getRightChild(file);
-    if (entry.validate()) {
-      buildFromTreeRecursive(file, entry, parent);
+  return sc_invalidHandle;
+}
+
+void Container::build(xdvdfs::Stream &file,
+                      const xdvdfs::VolumeDescriptor &vd) {
+  xdvdfs::FileEntry root("\\");
+  auto newHandle = registerFileEntry(root, sc_invalidHandle);
+
+  std::deque<TableScratch> scratch;
+  buildFromTable(file, vd.getRootDirTableSector(), vd.getRootDirTableSize(),
+                 newHandle, scratch, 0);
+
+  // Reservations are made from table sizes, which overestimate the entries
+  m_entries.shrink_to_fit();
+  m_parentHandles.shrink_to_fit();
+  m_foldedNames.shrink_to_fit();
+  m_foldedNameOffsets.shrink_to_fit();
+  m_foldedPaths.shrink_to_fit();
+  m_foldedPathOffsets.shrink_to_fit();
+}
+
+void Container::buildFromTable(xdvdfs::Stream &file, uint32_t sector,
+                               uint32_t size, EntryHandle parent,
+                               std::deque<TableScratch> &scratch,
+                               size_t depth) {
+  // Subtree offsets are 16 bit multiples of 4, which bounds a table
+  constexpr static size_t sc_maxTableSize = 0x10000 * 4;
+  constexpr static size_t sc_maxDepth = 256;
+
+  if (size == 0 || depth >= sc_maxDepth) {
+    return;
+  }
+
+  if (scratch.size() <= depth) {
+    scratch.emplace_back();
+  }
+  auto &level = scratch[depth];
+
+  // The whole table is read at once and the entries parsed in place
+  auto tableSize = std::min<size_t>(
+      (static_cast<size_t>(size) + xdvdfs::SECTOR_SIZE - 1) /
+          xdvdfs::SECTOR_SIZE * xdvdfs::SECTOR_SIZE,
+      sc_maxTableSize);
+  level.data.resize(tableSize);
+
+  auto tableOffset = static_cast<uint64_t>(file.m_offset) +
+                     static_cast<uint64_t>(sector) * xdvdfs::SECTOR_SIZE;
+  tableSize = static_cast<size_t>(
+      file.readAt(level.data.data(), tableSize, tableOffset));
+
+  reserveEntries(tableSize, parent);
+
+  // Pre-order walk of the binary tree: an entry, the contents of its
+  // directory, then its left and right subtrees. A well formed table has no
+  // more entries than this, which stops a cyclic one
+  auto remaining = tableSize / xdvdfs::FileEntry::NAME_OFFSET;
+
+  level.pending.clear();
+  level.pending.push_back(0);
+
+  while (!level.pending.empty() && remaining-- > 0) {
+    auto offset = level.pending.back();
+    level.pending.pop_back();
+
+    auto &entry = level.entry;
+    if (!entry.parse(level.data.data(), tableSize, offset, sector)) {
+      continue;
+    }
+
+    auto newHandle = registerFileEntry(entry, parent);
+
+    if (entry.hasRightChild()) {
+      level.pending.push_back(entry.getRightOffset());
+    }
+    if (entry.hasLeftChild()) {
+      level.pending.push_back(entry.getLeftOffset());
+    }
+
+    if (entry.isDirectory()) {
+      // Deeper levels never touch this one, so the entry stays intact
+      buildFromTable(file, entry.getStartSector(), entry.getFileSize(),
+                     newHandle, scratch, depth + 1);
     }
   }
 }
 
+void Container::reserveEntries(size_t tableSize, EntryHandle parent) {
+  // An entry takes at least its fixed fields, and the names with their
+  // terminators fit in the rest of the table
+  auto count = tableSize / xdvdfs::FileEntry::NAME_OFFSET;
+  auto parentLength = getFoldedPath(parent).size();
+
+  reserveColumn(m_entries, m_entries.size() + count);
+  reserveColumn(m_parentHandles, m_parentHandles.size() + count);
+  reserveColumn(m_foldedNameOffsets, m_foldedNameOffsets.size() + count);
+  reserveColumn(m_foldedPathOffsets, m_foldedPathOffsets.size() + count);
+  reserveColumn(m_foldedNames, m_foldedNames.size() + tableSize);
+  reserveColumn(m_foldedPaths, m_foldedPaths.size() +
+                                   count * (parentLength + 1) + tableSize);
+}
+
 Container::EntryHandle
 Container::registerFileEntry(const xdvdfs::FileEntry &dirent,
                              EntryHandle parent) {
@@ -124,24 +521,59 @@ Container::registerFileEntry(const xdvdfs::FileEntry &dirent,
   m_parentHandles.emplace_back(parent);
 
   auto newHandle = m_entries.size() - 1;
-
-  auto entryKey = resolveEntryKey(newHandle);
-  m_entryMap.emplace(entryKey, newHandle);
+  const auto &name = dirent.getFilename();
+
+  m_foldedNameOffsets.emplace_back(m_foldedNames.size());
+  appendFolded(m_foldedNames, name);
+  m_foldedNames += '\0';
+
+  // The parent's key with the name appended, as makeEntryKey gives for the
+  // path: a separator is added unless the parent key ends with one, as the
+  // root key "\\" does on Windows
+  constexpr static auto sc_separator =
+      static_cast<char>(std::filesystem::path::preferred_separator);
+
+  m_foldedPathOffsets.emplace_back(m_foldedPaths.size());
+  if (parent != sc_invalidHandle) {
+    auto parentLength = getFoldedPath(parent).size();
+    m_foldedPaths.append(m_foldedPaths, m_foldedPathOffsets[parent],
+                         parentLength);
+    if (parentLength == 0 || m_foldedPaths.back() != sc_separator) {
+      m_foldedPaths += sc_separator;
+    }
+  }
+  appendFolded(m_foldedPaths, name);
+  m_foldedPaths += '\0';
 
   return newHandle;
 }
 
 std::string Container::makeEntryKey(const std::filesystem::path &path) const {
   auto result = path.string();
-
-  // Enforce case-insensitive name resolution
-  std::transform(result.begin(), result.end(), result.begin(),
-                 [](char c) { return static_cast<char>(::tolower(c)); });
+  std::transform(result.begin(), result.end(), result.begin(), foldChar);
 
   return result;
 }
 
-std::string Container::resolveEntryKey(EntryHandle handle) const {
+std::string_view Container::getFoldedPath(EntryHandle handle) const {
+  auto offset = m_foldedPathOffsets[handle];
+  auto end = handle + 1 < m_foldedPathOffsets.size()
+                 ? m_foldedPathOffsets[handle + 1]
+                 : m_foldedPaths.size();
+
+  // Excluding the terminator
+  return std::string_view(m_foldedPaths.data() + offset, end - offset - 1);
+}
+
+std::string Container::getPath(EntryHandle handle) const {
+  if (handle < m_entries.size()) {
+    return resolvePath(handle).string();
+  }
+
+  return {};
+}
+
+std::filesystem::path Container::resolvePath(EntryHandle handle) const {
   // Parent traversal; build a reverse list of any path handles
   std::vector<EntryHandle> handles;
   handles.emplace_back(handle);
@@ -163,16 +595,43 @@ std::string Container::resolveEntryKey(EntryHandle handle) const {
     finalPath /= m_entries[childHandle].getFilename();
   }
 
-  return makeEntryKey(finalPath);
+  return finalPath;
+}
+
+Container::EntryHandle Container::lookupPath(const std::string &path) const {
+  // Rebuild the path the way the entries are keyed
+  std::filesystem::path native("\\");
+  std::string component;
+
+  for (auto c : path) {
+    if (c == '/' || c == '\\') {
+      if (!component.empty()) {
+        native /= component;
+        component.clear();
+      }
+    } else {
+      component += c;
+    }
+  }
+
+  if (!component.empty()) {
+    native /= component;
+  }
+
+  return getHandle(native);
 }
 
 Container::EntryHandle
 Container::getHandle(const std::filesystem::path &path) const {
   auto key = makeEntryKey(path);
 
-  auto it = m_entryMap.find(key);
-  if (it != m_entryMap.end()) {
-    return it->second;
+  auto it = std::lower_bound(
+      m_pathIndex.begin(), m_pathIndex.end(), key,
+      [this](EntryHandle handle, const std::string &value) {
+        return getFoldedPath(handle) < value;
+      });
+  if (it != m_pathIndex.end() && getFoldedPath(*it) == key) {
+    return *it;
   }
 
   return sc_invalidHandle;
@@ -2,65 +2,233 @@
 
 #pragma once
 
+#include "vfs_hash.h"
+#include "vfs_memory.h"
 #include "xdvdfs.h"
 
+#include <atomic>
+#include <deque>
 #include <filesystem>
 #include <iostream>
-#include <map>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace vfs {
+class AccessTrace;
+class ContentStore;
+struct FindQuery;
+
 enum class SetupState {
   ErrorFile,
   ErrorFormat,
   Success,
 };
 
+// Conversions between paths and wide strings which never throw. On POSIX,
+// std::filesystem converts through the C locale and fails on any name outside
+// ASCII, so UTF-8 is converted here instead; invalid bytes become U+FFFD
+std::wstring toWideString(const std::filesystem::path &path);
+std::filesystem::path fromWideString(const std::wstring &text);
+
+// Directory listing entry which is materialized once after indexing. Names
+// are stored widened and null-terminated in a shared pool so frontends can
+// copy them out directly
+struct ListingRecord {
+  size_t handle;
+  size_t nameOffset;   ///< offset into the listing name pool
+  uint16_t nameLength; ///< in characters, excluding the terminator
+  uint8_t attributes;  ///< xdvdfs::FileEntry FILE_* flags
+  uint32_t fileSize;
+  uint64_t modified; ///< FILETIME of the volume
+};
+
+// Contiguous slice of a directory listing. Pass next back in as the cursor to
+// resume the enumeration; it equals the total count once complete
+struct ListingPage {
+  const ListingRecord *records{nullptr};
+  size_t count{0};
+  size_t next{0};
+  bool complete{true};
+};
+
+// Run of sectors relative to the start of the game partition
+struct SectorExtent {
+  uint32_t sector;
+  uint32_t count;
+  size_t handle; ///< owning entry; invalid for the volume header
+};
+
 class Container {
 public:
   using EntryHandle = size_t;
+  constexpr static EntryHandle sc_invalidHandle = ~0U;
+
+  Container() = default;
+  ~Container();
+
+  // With directIO the image is read around the OS file cache, staged through
+  // the process wide aligned buffer pool
+  SetupState setup(const std::filesystem::path &filename,
+                   bool directIO = false);
 
-  SetupState setup(const std::wstring &filename);
+  // Same as setup, for a stream opened by the caller. A stream holding only
+  // the volume descriptor and directory tables as resident extents gives a
+  // complete index, but its files cannot be read
+  SetupState setupFromStream(std::unique_ptr<xdvdfs::Stream> stream,
+                             const std::filesystem::path &path,
+                             uint64_t volumeSize);
+
+  // Index persisted by saveIndex, with file data served from a content store
+  // instead of the original image
+  SetupState setupFromIndex(const std::filesystem::path &path,
+                            ContentStore &store);
+  bool saveIndex(const std::filesystem::path &path) const;
+
+  // Content hashes of every entry (empty for directories), which also link
+  // this index to a content store
+  void setContentHashes(std::vector<ContentHash> hashes) {
+    m_contentHashes = std::move(hashes);
+  }
+
+  uint32_t readEntry(EntryHandle handle, void *buffer, uint32_t bufferlength,
+                     int64_t offset) const;
+
+  uint64_t getReadCount() const { return m_readCount; }
+  uint64_t getReadBytes() const { return m_readBytes; }
 
   const xdvdfs::FileEntry *getEntry(const std::filesystem::path &path) const;
   const xdvdfs::FileEntry *getEntry(EntryHandle handle) const;
 
+  EntryHandle getHandle(const std::filesystem::path &path) const;
+
+  // Handle of a path as users write it: either separator, with or without
+  // the leading root, so "media/a.xmv" and "\\media\\a.xmv" both resolve
+  EntryHandle lookupPath(const std::string &path) const;
+  EntryHandle getParentHandle(EntryHandle handle) const {
+    return m_parentHandles[handle];
+  }
+
   using FileResults = std::vector<EntryHandle>;
   FileResults getFolderList(const std::filesystem::path &path) const;
 
+  ListingPage getListing(const std::filesystem::path &path, size_t cursor = 0,
+                         size_t maxRecords = ~size_t(0)) const;
+  ListingPage getListing(EntryHandle handle, size_t cursor = 0,
+                         size_t maxRecords = ~size_t(0)) const;
+  const wchar_t *getListingName(const ListingRecord &record) const {
+    return m_listingNames.data() + record.nameOffset;
+  }
+
+  FileResults find(const FindQuery &query) const;
+
+  std::string getPath(EntryHandle handle) const;
+
   uint64_t getVolumeModified() const { return m_volumeModified; }
   uint64_t getVolumeSize() const { return m_volumeSize; }
+  const xdvdfs::VolumeDescriptor &getVolumeDescriptor() const {
+    return m_volumeDescriptor;
+  }
 
   xdvdfs::Stream *getFileStream() const { return m_stream.get(); }
 
   const std::wstring &getFilename() const { return m_name; }
+  const std::filesystem::path &getImagePath() const { return m_path; }
 
-protected:
-  void build(xdvdfs::Stream &file, xdvdfs::FileEntry &dirent);
-  void buildFromTreeRecursive(xdvdfs::Stream &file, xdvdfs::FileEntry &dirent,
-                              EntryHandle parent);
+  // Optional trace of first reads, set before mounting
+  void setAccessTrace(AccessTrace *trace) { m_accessTrace = trace; }
+  AccessTrace *getAccessTrace() const { return m_accessTrace; }
+
+  size_t getEntryCount() const { return m_entries.size(); }
+
+  // Estimated heap held by the index: entries, path index, listings and
+  // search columns. Charged to the memory governor once set up
+  uint64_t getIndexSize() const;
+
+  // Every sector the image uses: the volume header, directory tables and file
+  // data, sorted by sector. Only built for containers read from an image
+  const std::vector<SectorExtent> &getSectorExtents() const {
+    return m_sectorExtents;
+  }
 
+  // Merged runs of used sectors; every other sector is padding
+  const std::vector<SectorExtent> &getUsedSectors() const {
+    return m_usedSectors;
+  }
+
+  // Entry owning the sector, or sc_invalidHandle for the header and unused
+  // sectors. Directories own their tables. Where extents overlap, the sector
+  // belongs to the one starting last, and of those to the shortest
+  EntryHandle getEntryAtSector(uint32_t sector) const;
+
+protected:
+  // Scratch space for one level of the directory tree, reused for every
+  // table at that depth
+  struct TableScratch {
+    std::vector<uint8_t> data;
+    std::vector<size_t> pending; ///< entry offsets still to visit
+    xdvdfs::FileEntry entry;
+  };
+
+  void build(xdvdfs::Stream &file, const xdvdfs::VolumeDescriptor &vd);
+  void buildFromTable(xdvdfs::Stream &file, uint32_t sector, uint32_t size,
+                      EntryHandle parent, std::deque<TableScratch> &scratch,
+                      size_t depth);
+
+  void buildListings();
+  void buildPathIndex();
+  void buildSectorMap();
+  void chargeIndexMemory();
+
+  // Grows the entry columns ahead of a directory table, from its size
+  void reserveEntries(size_t tableSize, EntryHandle parent);
   EntryHandle registerFileEntry(const xdvdfs::FileEntry &dirent,
                                 EntryHandle parent);
 
   std::string makeEntryKey(const std::filesystem::path &path) const;
-  std::string resolveEntryKey(EntryHandle handle) const;
-
-  EntryHandle getHandle(const std::filesystem::path &path) const;
+  std::string_view getFoldedPath(EntryHandle handle) const;
+  std::filesystem::path resolvePath(EntryHandle handle) const;
 
 private:
-  constexpr static EntryHandle sc_invalidHandle = ~0U;
 
   std::vector<xdvdfs::FileEntry> m_entries; // flat entries
   std::vector<EntryHandle> m_parentHandles; // flag lookup
-  std::map<std::string, EntryHandle> m_entryMap;
+
+  // Case-folded name and path columns used by find and path lookup; each
+  // value is stored null-terminated and indexed by handle. The folded paths
+  // double as the lookup keys
+  std::string m_foldedNames;
+  std::vector<size_t> m_foldedNameOffsets;
+  std::string m_foldedPaths;
+  std::vector<size_t> m_foldedPathOffsets;
+  std::vector<EntryHandle> m_pathIndex; ///< handles sorted by folded path
+
+  // Listing records grouped by parent; the children of a directory are the
+  // records between m_listingOffsets[handle] and m_listingOffsets[handle + 1]
+  std::vector<ListingRecord> m_listingRecords;
+  std::vector<size_t> m_listingOffsets;
+  std::wstring m_listingNames;
+
+  std::vector<SectorExtent> m_sectorExtents;
+  std::vector<SectorExtent> m_usedSectors;
 
   std::wstring m_name;
+  std::filesystem::path m_path;
 
+  xdvdfs::VolumeDescriptor m_volumeDescriptor;
   uint64_t m_volumeModified{0};
   uint64_t m_volumeSize{0};
 
   std::unique_ptr<xdvdfs::Stream> m_stream;
+
+  AccessTrace *m_accessTrace{nullptr};
+
+  std::vector<ContentHash> m_contentHashes;
+  ContentStore *m_contentStore{nullptr};
+
+  mutable std::atomic<uint64_t> m_readCount{0};
+  mutable std::atomic<uint64_t> m_readBytes{0};
+
+  MemoryGovernor::ConsumerId m_memoryId{0};
 };
 } // namespace vfs
@@ -0,0 +1,350 @@
+// Part of xbox-iso-vfs
+
+#include "vfs_erofs.h"
+#include "vfs_sparse.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+namespace vfs {
+namespace {
+// On-disk format as described in the kernel's fs/erofs/erofs_fs.h
+constexpr static uint32_t sc_blockSize = 4096;
+constexpr static uint8_t sc_blockSizeBits = 12;
+constexpr static uint32_t sc_superblockOffset = 1024;
+constexpr static uint32_t sc_magic = 0xE0F5E1E2;
+constexpr static uint32_t sc_inodeSize = 32; ///< compact inode
+constexpr static uint32_t sc_direntSize = 12;
+
+constexpr static uint8_t sc_fileTypeRegular = 1;
+constexpr static uint8_t sc_fileTypeDirectory = 2;
+
+constexpr static uint16_t sc_modeDirectory = 0040000 | 0555;
+constexpr static uint16_t sc_modeRegular = 0100000 | 0444;
+
+constexpr static uint32_t sc_copyChunkSize = 1024 * 1024;
+
+// Seconds between the FILETIME and Unix epochs
+constexpr static uint64_t sc_filetimeUnixOffset = 11644473600;
+
+struct DirectoryName {
+  std::string name;
+  uint64_t nid;
+  uint8_t fileType;
+};
+
+struct Directory {
+  Container::EntryHandle handle;
+  std::vector<uint8_t> blocks;
+  uint32_t size{0}; ///< bytes in use, the last block may be partial
+  uint32_t blockAddress{0};
+  uint16_t links{2};
+};
+
+struct CopyChunk {
+  Container::EntryHandle handle;
+  uint32_t offset;
+  uint32_t length;
+  uint64_t destination;
+};
+
+// Inodes are packed from the first block after the superblock, in handle
+// order, so the node number follows from the handle
+uint64_t getNid(Container::EntryHandle handle) {
+  return sc_blockSize / sc_inodeSize + handle;
+}
+
+uint32_t blockCount(uint64_t size) {
+  return static_cast<uint32_t>((size + sc_blockSize - 1) / sc_blockSize);
+}
+
+// Names are compared as unsigned bytes, as the kernel's lookup does
+bool nameLess(const DirectoryName &a, const DirectoryName &b) {
+  auto length = std::min(a.name.size(), b.name.size());
+  auto result = std::memcmp(a.name.data(), b.name.data(), length);
+
+  return result != 0 ? result < 0 : a.name.size() < b.name.size();
+}
+
+// Packs the sorted dirents into blocks. Each block starts with its dirents
+// followed by their names; a name never crosses into the next block
+void packDirectory(Directory &directory, std::vector<DirectoryName> names) {
+  std::sort(names.begin(), names.end(), nameLess);
+
+  uint32_t lastBlockUsed = 0;
+
+  for (size_t first = 0; first < names.size();) {
+    size_t count = 0;
+    uint32_t nameBytes = 0;
+
+    while (first + count < names.size() &&
+           (count + 1) * sc_direntSize + nameBytes +
+                   names[first + count].name.size() <=
+               sc_blockSize) {
+      nameBytes += static_cast<uint32_t>(names[first + count].name.size());
+      ++count;
+    }
+
+    auto block = directory.blocks.size();
+    directory.blocks.resize(block + sc_blockSize, 0);
+
+    auto nameOffset = static_cast<uint32_t>(count * sc_direntSize);
+
+    for (size_t i = 0; i < count; ++i) {
+      const auto &name = names[first + i];
+      auto dirent = &directory.blocks[block + i * sc_direntSize];
+
+      xdvdfs::storeLittleEndian64(dirent, name.nid);
+      xdvdfs::storeLittleEndian16(dirent + 8,
+                                  static_cast<uint16_t>(nameOffset));
+      dirent[10] = name.fileType;
+
+      std::memcpy(&directory.blocks[block + nameOffset], name.name.data(),
+                  name.name.size());
+      nameOffset += static_cast<uint32_t>(name.name.size());
+    }
+
+    lastBlockUsed = nameOffset;
+    first += count;
+  }
+
+  directory.size = static_cast<uint32_t>(directory.blocks.size()) -
+                   sc_blockSize + lastBlockUsed;
+}
+
+void storeInode(uint8_t *inode, uint16_t mode, uint16_t links, uint32_t size,
+                uint32_t blockAddress, uint32_t ino) {
+  // i_format 0: compact layout with flat plain data
+  xdvdfs::storeLittleEndian16(inode + 0x04, mode);
+  xdvdfs::storeLittleEndian16(inode + 0x06, links);
+  xdvdfs::storeLittleEndian32(inode + 0x08, size);
+  xdvdfs::storeLittleEndian32(inode + 0x10, blockAddress);
+  xdvdfs::storeLittleEndian32(inode + 0x14, ino);
+}
+} // namespace
+
+ErofsReport exportErofs(const Container &container,
+                        const std::filesystem::path &output,
+                        unsigned threadCount) {
+  ErofsReport report;
+
+  auto entryCount = container.getEntryCount();
+  if (entryCount == 0) {
+    return report;
+  }
+
+  // Directory contents, with . and .. as the kernel expects
+  std::vector<Directory> directories;
+  std::vector<Container::EntryHandle> files;
+
+  for (Container::EntryHandle handle = 0; handle < entryCount; ++handle) {
+    if (!container.getEntry(handle)->isDirectory()) {
+      files.emplace_back(handle);
+      continue;
+    }
+
+    auto parent = handle == 0 ? handle : container.getParentHandle(handle);
+
+    Directory directory;
+    directory.handle = handle;
+
+    std::vector<DirectoryName> names{
+        {".", getNid(handle), sc_fileTypeDirectory},
+        {"..", getNid(parent), sc_fileTypeDirectory}};
+
+    auto listing = container.getListing(handle);
+    for (size_t i = 0; i < listing.count; ++i) {
+      auto child = listing.records[i].handle;
+      auto entry = container.getEntry(child);
+
+      names.push_back({entry->getFilename(), getNid(child),
+                       entry->isDirectory() ? sc_fileTypeDirectory
+                                            : sc_fileTypeRegular});
+      if (entry->isDirectory()) {
+        ++directory.links;
+      }
+    }
+
+    packDirectory(directory, std::move(names));
+    directories.emplace_back(std::move(directory));
+  }
+
+  // Superblock, inodes, directories, then file data in on-disc order
+  uint32_t cursor = 1 + blockCount(static_cast<uint64_t>(entryCount) *
+                                   sc_inodeSize);
+
+  for (auto &directory : directories) {
+    directory.blockAddress = cursor;
+    cursor += static_cast<uint32_t>(directory.blocks.size() / sc_blockSize);
+  }
+
+  std::stable_sort(files.begin(), files.end(),
+                   [&container](Container::EntryHandle a,
+                                Container::EntryHandle b) {
+                     return container.getEntry(a)->getStartSector() <
+                            container.getEntry(b)->getStartSector();
+                   });
+
+  std::vector<uint32_t> fileBlocks(entryCount, 0);
+  std::vector<CopyChunk> chunks;
+
+  for (auto handle : files) {
+    auto size = container.getEntry(handle)->getFileSize();
+    if (size == 0) {
+      continue;
+    }
+
+    fileBlocks[handle] = cursor;
+
+    for (uint64_t done = 0; done < size; done += sc_copyChunkSize) {
+      auto length = static_cast<uint32_t>(
+          std::min<uint64_t>(sc_copyChunkSize, size - done));
+      chunks.push_back({handle, static_cast<uint32_t>(done), length,
+                        static_cast<uint64_t>(cursor) * sc_blockSize + done});
+    }
+
+    cursor += blockCount(size);
+  }
+
+  auto imageSize = static_cast<uint64_t>(cursor) * sc_blockSize;
+
+  SparseFile file;
+  bool sparse;
+  if (!file.create(output, imageSize, sparse)) {
+    return report;
+  }
+
+  // Superblock; the checksum is optional and left out
+  std::vector<uint8_t> block(sc_blockSize, 0);
+  auto superblock = block.data() + sc_superblockOffset;
+
+  auto buildTime = container.getVolumeModified() / 10000000;
+  buildTime =
+      buildTime > sc_filetimeUnixOffset ? buildTime - sc_filetimeUnixOffset : 0;
+
+  xdvdfs::storeLittleEndian32(superblock + 0x00, sc_magic);
+  superblock[0x0C] = sc_blockSizeBits;
+  xdvdfs::storeLittleEndian16(superblock + 0x0E,
+                              static_cast<uint16_t>(getNid(0)));
+  xdvdfs::storeLittleEndian64(superblock + 0x10, entryCount);
+  xdvdfs::storeLittleEndian64(superblock + 0x18, buildTime);
+  xdvdfs::storeLittleEndian32(superblock + 0x24, cursor);
+
+  // Volume label, limited to ASCII
+  const auto &volumeName = container.getFilename();
+  for (size_t i = 0; i < volumeName.size() && i < 16; ++i) {
+    superblock[0x40 + i] =
+        volumeName[i] < 0x80 ? static_cast<uint8_t>(volumeName[i]) : '_';
+  }
+
+  if (!file.write(0, reinterpret_cast<const char *>(block.data()),
+                  block.size())) {
+    return report;
+  }
+
+  // Inodes
+  std::vector<uint8_t> inodes(static_cast<size_t>(entryCount) * sc_inodeSize,
+                              0);
+
+  for (const auto &directory : directories) {
+    storeInode(&inodes[directory.handle * sc_inodeSize], sc_modeDirectory,
+               directory.links, directory.size, directory.blockAddress,
+               static_cast<uint32_t>(directory.handle + 1));
+  }
+
+  for (auto handle : files) {
+    storeInode(&inodes[handle * sc_inodeSize], sc_modeRegular, 1,
+               container.getEntry(handle)->getFileSize(), fileBlocks[handle],
+               static_cast<uint32_t>(handle + 1));
+  }
+
+  if (!file.write(sc_blockSize, reinterpret_cast<const char *>(inodes.data()),
+                  inodes.size())) {
+    return report;
+  }
+
+  for (const auto &directory : directories) {
+    if (!file.write(static_cast<uint64_t>(directory.blockAddress) *
+                        sc_blockSize,
+                    reinterpret_cast<const char *>(directory.blocks.data()),
+                    directory.blocks.size())) {
+      return report;
+    }
+  }
+
+  // File data. Workers claim chunks in order, so the image is read close to
+  // sequentially however many there are
+  if (threadCount == 0) {
+    threadCount = std::max(1u, std::thread::hardware_concurrency());
+  }
+  threadCount = std::max(
+      1u, std::min<unsigned>(threadCount, static_cast<unsigned>(chunks.size())));
+
+  auto stream = container.getFileStream();
+
+  std::atomic<size_t> nextChunk{0};
+  std::atomic<bool> failed{false};
+
+  auto worker = [&]() {
+    // Images are read through a stream of the worker's own, as in
+    // makeResident; indexes served from a content store go through it
+    xdvdfs::Stream ownStream;
+    auto reader = stream;
+    if (stream && !stream->isDirect()) {
+      if (!ownStream.open(stream->getPartPaths(), false)) {
+        failed = true;
+        return;
+      }
+      ownStream.m_offset = stream->m_offset;
+      reader = &ownStream;
+    }
+
+    std::vector<char> buffer(sc_copyChunkSize);
+
+    for (auto index = nextChunk++; index < chunks.size() && !failed;
+         index = nextChunk++) {
+      const auto &chunk = chunks[index];
+      auto entry = container.getEntry(chunk.handle);
+
+      auto length =
+          reader ? entry->read(*reader, buffer.data(), chunk.length,
+                               chunk.offset)
+                 : container.readEntry(chunk.handle, buffer.data(),
+                                       chunk.length, chunk.offset);
+
+      if (length != chunk.length ||
+          !file.write(chunk.destination, buffer.data(), length)) {
+        failed = true;
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned i = 0; i < threadCount; ++i) {
+    workers.emplace_back(worker);
+  }
+
+  for (auto &thread : workers) {
+    thread.join();
+  }
+
+  if (failed) {
+    return report;
+  }
+
+  for (auto handle : files) {
+    report.dataBytes += container.getEntry(handle)->getFileSize();
+  }
+
+  report.files = files.size();
+  report.directories = directories.size();
+  report.imageSize = imageSize;
+  report.bufferBytes = static_cast<uint64_t>(threadCount) * sc_copyChunkSize;
+  report.success = true;
+
+  return report;
+}
+} // namespace vfs
@@ -0,0 +1,27 @@
+// Part of xbox-iso-vfs
+
+#pragma once
+
+#include "vfs.h"
+
+#include <filesystem>
+
+namespace vfs {
+struct ErofsReport {
+  bool success{false};
+  size_t files{0};
+  size_t directories{0};
+  uint64_t dataBytes{0};   ///< file contents copied
+  uint64_t imageSize{0};   ///< size of the EROFS image
+  uint64_t bufferBytes{0}; ///< copy buffers held at once
+};
+
+// Converts the image to an uncompressed EROFS image with 4 KiB blocks, which
+// Linux mounts read-only with "mount -t erofs -o loop". Names are kept as
+// stored; lookups in the mounted copy are case sensitive. File data is laid
+// out in on-disc sector order and copied by threadCount readers (one per
+// core when 0), each through a single fixed size buffer
+ErofsReport exportErofs(const Container &container,
+                        const std::filesystem::path &output,
+                        unsigned threadCount = 0);
+} // namespace vfs
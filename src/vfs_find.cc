@@ -0,0 +1,269 @@
+// Part of xbox-iso-vfs
+
+#include "vfs_find.h"
+
+#include <algorithm>
+#include <atomic>
+#include <string_view>
+#include <thread>
+
+namespace vfs {
+namespace {
+bool globMatch(std::string_view pattern, std::string_view text) {
+  size_t p = 0;
+  size_t t = 0;
+  size_t starPattern = std::string_view::npos;
+  size_t starText = 0;
+
+  while (t < text.size()) {
+    if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == text[t])) {
+      ++p;
+      ++t;
+    } else if (p < pattern.size() && pattern[p] == '*') {
+      starPattern = p++;
+      starText = t;
+    } else if (starPattern != std::string_view::npos) {
+      // Let the last star swallow one more character and retry
+      p = starPattern + 1;
+      t = ++starText;
+    } else {
+      return false;
+    }
+  }
+
+  while (p < pattern.size() && pattern[p] == '*') {
+    ++p;
+  }
+
+  return p == pattern.size();
+}
+
+// Longest run of the glob without wildcards; every match must contain it
+std::string_view longestLiteral(std::string_view pattern) {
+  std::string_view best;
+
+  size_t start = 0;
+  while (start <= pattern.size()) {
+    auto end = pattern.find_first_of("*?", start);
+    if (end == std::string_view::npos) {
+      end = pattern.size();
+    }
+
+    if (end - start > best.size()) {
+      best = pattern.substr(start, end - start);
+    }
+
+    start = end + 1;
+  }
+
+  return best;
+}
+
+std::string_view columnValue(const std::string &column,
+                             const std::vector<size_t> &offsets,
+                             size_t handle) {
+  auto begin = offsets[handle];
+  auto end = (handle + 1 < offsets.size()) ? offsets[handle + 1] - 1
+                                           : column.size() - 1;
+
+  return std::string_view(column).substr(begin, end - begin);
+}
+
+// Find every entry whose column value contains the needle. This is a single
+// pass over the contiguous column, which lets the library memchr/memcmp
+// routines run vectorized instead of testing entries one at a time. Values
+// are null-terminated so a hit can never straddle two entries
+Container::FileResults scanColumn(const std::string &column,
+                                  const std::vector<size_t> &offsets,
+                                  std::string_view needle) {
+  Container::FileResults results;
+
+  std::string_view haystack(column);
+  auto pos = haystack.find(needle);
+
+  while (pos != std::string_view::npos) {
+    auto it = std::upper_bound(offsets.begin(), offsets.end(), pos);
+    auto handle = static_cast<Container::EntryHandle>(
+        std::distance(offsets.begin(), it) - 1);
+
+    results.emplace_back(handle);
+
+    if (it == offsets.end()) {
+      break;
+    }
+
+    pos = haystack.find(needle, *it);
+  }
+
+  return results;
+}
+} // namespace
+
+bool FindQuery::parse(const std::string &pattern, FindQuery &query) {
+  query = FindQuery();
+
+  if (pattern.size() >= 2 && pattern.front() == '/' && pattern.back() == '/') {
+    query.syntax = Syntax::Regex;
+    query.pattern = pattern.substr(1, pattern.size() - 2);
+
+    // An unescaped / selects the full path and stands for either separator,
+    // so the same expression works whatever the host uses
+    std::string expression;
+    bool escaped = false;
+    bool inClass = false;
+
+    for (auto c : query.pattern) {
+      if (escaped) {
+        escaped = false;
+      } else if (c == '\\') {
+        escaped = true;
+      } else if (c == '[') {
+        inClass = true;
+      } else if (c == ']') {
+        inClass = false;
+      } else if (c == '/') {
+        query.matchFullPath = true;
+        expression += inClass ? "\\\\/" : "[\\\\/]";
+        continue;
+      }
+
+      expression += c;
+    }
+
+    try {
+      query.expression =
+          std::regex(expression, std::regex::ECMAScript | std::regex::icase |
+                                     std::regex::optimize);
+    } catch (const std::regex_error &) {
+      return false;
+    }
+
+    return true;
+  }
+
+  query.pattern = pattern;
+
+  std::transform(query.pattern.begin(), query.pattern.end(),
+                 query.pattern.begin(), [](char c) {
+                   if (c == '/' || c == '\\') {
+                     return static_cast<char>(
+                         std::filesystem::path::preferred_separator);
+                   }
+                   return static_cast<char>(::tolower(c));
+                 });
+
+  query.matchFullPath = query.pattern.find(static_cast<char>(
+                            std::filesystem::path::preferred_separator)) !=
+                        std::string::npos;
+
+  if (query.pattern.find_first_of("*?") != std::string::npos) {
+    query.syntax = Syntax::Glob;
+  }
+
+  return true;
+}
+
+Container::FileResults Container::find(const FindQuery &query) const {
+  const auto &column = query.matchFullPath ? m_foldedPaths : m_foldedNames;
+  const auto &offsets =
+      query.matchFullPath ? m_foldedPathOffsets : m_foldedNameOffsets;
+
+  FileResults results;
+
+  switch (query.syntax) {
+  case FindQuery::Syntax::Substring: {
+    results = scanColumn(column, offsets, query.pattern);
+  } break;
+  case FindQuery::Syntax::Glob: {
+    // Narrow down with the literal part first, then confirm the full glob
+    auto candidates = scanColumn(column, offsets, longestLiteral(query.pattern));
+
+    for (auto handle : candidates) {
+      if (globMatch(query.pattern, columnValue(column, offsets, handle))) {
+        results.emplace_back(handle);
+      }
+    }
+  } break;
+  case FindQuery::Syntax::Regex: {
+    for (size_t i = 0; i < offsets.size(); ++i) {
+      auto value = columnValue(column, offsets, i);
+      if (std::regex_search(value.begin(), value.end(), query.expression)) {
+        results.emplace_back(i);
+      }
+    }
+  } break;
+  }
+
+  // The root entry is synthetic and never reported
+  results.erase(std::remove_if(results.begin(), results.end(),
+                               [this](EntryHandle handle) {
+                                 return m_parentHandles[handle] ==
+                                        sc_invalidHandle;
+                               }),
+                results.end());
+
+  return results;
+}
+
+LibraryResults findInImages(const std::vector<std::wstring> &images,
+                            const FindQuery &query, unsigned threadCount) {
+  if (threadCount == 0) {
+    threadCount = std::max(1u, std::thread::hardware_concurrency());
+  }
+  threadCount = std::min<unsigned>(
+      threadCount, static_cast<unsigned>(std::max<size_t>(images.size(), 1)));
+
+  // Each worker writes only to the slots of the images it claimed, so the
+  // results can be merged in input order without further locking
+  std::vector<std::vector<FindMatch>> matchSlots(images.size());
+  std::vector<SetupState> states(images.size(), SetupState::Success);
+  std::atomic<size_t> nextImage{0};
+
+  auto worker = [&]() {
+    for (auto index = nextImage++; index < images.size();
+         index = nextImage++) {
+      Container container;
+
+      states[index] = container.setup(fromWideString(images[index]));
+      if (states[index] != SetupState::Success) {
+        continue;
+      }
+
+      for (auto handle : container.find(query)) {
+        auto entry = container.getEntry(handle);
+
+        FindMatch match;
+        match.imageIndex = index;
+        match.path = container.getPath(handle);
+        match.fileSize = entry->getFileSize();
+        match.isDirectory = entry->isDirectory();
+
+        matchSlots[index].emplace_back(std::move(match));
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned i = 0; i < threadCount; ++i) {
+    workers.emplace_back(worker);
+  }
+
+  for (auto &thread : workers) {
+    thread.join();
+  }
+
+  LibraryResults results;
+
+  for (size_t i = 0; i < images.size(); ++i) {
+    if (states[i] != SetupState::Success) {
+      results.failures.emplace_back(i, states[i]);
+      continue;
+    }
+
+    std::move(matchSlots[i].begin(), matchSlots[i].end(),
+              std::back_inserter(results.matches));
+  }
+
+  return results;
+}
+} // namespace vfs
@@ -0,0 +1,48 @@
+// Part of xbox-iso-vfs
+
+#pragma once
+
+#include "vfs.h"
+
+#include <regex>
+#include <string>
+#include <vector>
+
+namespace vfs {
+struct FindQuery {
+  enum class Syntax {
+    Substring,
+    Glob,
+    Regex,
+  };
+
+  // Patterns containing * or ? are globs, patterns wrapped in /slashes/ are
+  // regular expressions and anything else is a substring. Patterns containing
+  // a / or \ are matched against the full path instead of the name; within a
+  // regular expression only an unescaped / counts, and matches either
+  // separator. Returns false when the regular expression does not compile
+  static bool parse(const std::string &pattern, FindQuery &query);
+
+  std::string pattern; ///< case-folded pattern text
+  Syntax syntax{Syntax::Substring};
+  bool matchFullPath{false};
+  std::regex expression; ///< compiled once, shared by every image searched
+};
+
+struct FindMatch {
+  size_t imageIndex{0};
+  std::string path;
+  uint32_t fileSize{0};
+  bool isDirectory{false};
+};
+
+struct LibraryResults {
+  std::vector<FindMatch> matches; ///< ordered by image, then by handle
+  std::vector<std::pair<size_t, SetupState>> failures;
+};
+
+// Indexes each image and runs the query against it, spreading the images over
+// a pool of worker threads (0 uses the hardware concurrency)
+LibraryResults findInImages(const std::vector<std::wstring> &images,
+                            const FindQuery &query, unsigned threadCount = 0);
+} // namespace vfs
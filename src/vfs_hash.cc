@@ -0,0 +1,156 @@
+// Part of xbox-iso-vfs
+
+#include "vfs_hash.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace vfs {
+namespace {
+constexpr static uint32_t sc_roundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+uint32_t rotateRight(uint32_t value, int bits) {
+  return (value >> bits) | (value << (32 - bits));
+}
+} // namespace
+
+Sha256::Sha256()
+    : m_state{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f,
+              0x9b05688c, 0x1f83d9ab, 0x5be0cd19} {}
+
+void Sha256::update(const void *data, size_t length) {
+  auto bytes = static_cast<const uint8_t *>(data);
+  m_totalLength += length;
+
+  // Top up a partial block first
+  if (m_blockLength > 0) {
+    auto take = std::min(length, sizeof(m_block) - m_blockLength);
+    std::memcpy(m_block + m_blockLength, bytes, take);
+
+    m_blockLength += take;
+    bytes += take;
+    length -= take;
+
+    if (m_blockLength < sizeof(m_block)) {
+      return;
+    }
+
+    transform(m_block);
+    m_blockLength = 0;
+  }
+
+  while (length >= sizeof(m_block)) {
+    transform(bytes);
+    bytes += sizeof(m_block);
+    length -= sizeof(m_block);
+  }
+
+  std::memcpy(m_block, bytes, length);
+  m_blockLength = length;
+}
+
+ContentHash Sha256::finish() {
+  auto bitLength = m_totalLength * 8;
+
+  uint8_t padding[72] = {0x80};
+  auto paddingLength = (m_blockLength < 56) ? (56 - m_blockLength)
+                                            : (120 - m_blockLength);
+
+  for (int i = 0; i < 8; ++i) {
+    padding[paddingLength + i] =
+        static_cast<uint8_t>(bitLength >> (56 - i * 8));
+  }
+
+  update(padding, paddingLength + 8);
+
+  ContentHash hash;
+  for (int i = 0; i < 8; ++i) {
+    hash[i * 4 + 0] = static_cast<uint8_t>(m_state[i] >> 24);
+    hash[i * 4 + 1] = static_cast<uint8_t>(m_state[i] >> 16);
+    hash[i * 4 + 2] = static_cast<uint8_t>(m_state[i] >> 8);
+    hash[i * 4 + 3] = static_cast<uint8_t>(m_state[i]);
+  }
+
+  return hash;
+}
+
+std::string Sha256::toString(const ContentHash &hash) {
+  constexpr static char sc_digits[] = "0123456789abcdef";
+
+  std::string result;
+  result.reserve(hash.size() * 2);
+
+  for (auto byte : hash) {
+    result += sc_digits[byte >> 4];
+    result += sc_digits[byte & 0x0F];
+  }
+
+  return result;
+}
+
+void Sha256::transform(const uint8_t *block) {
+  uint32_t schedule[64];
+
+  for (int i = 0; i < 16; ++i) {
+    schedule[i] = (static_cast<uint32_t>(block[i * 4]) << 24) |
+                  (static_cast<uint32_t>(block[i * 4 + 1]) << 16) |
+                  (static_cast<uint32_t>(block[i * 4 + 2]) << 8) |
+                  static_cast<uint32_t>(block[i * 4 + 3]);
+  }
+
+  for (int i = 16; i < 64; ++i) {
+    auto s0 = rotateRight(schedule[i - 15], 7) ^
+              rotateRight(schedule[i - 15], 18) ^ (schedule[i - 15] >> 3);
+    auto s1 = rotateRight(schedule[i - 2], 17) ^
+              rotateRight(schedule[i - 2], 19) ^ (schedule[i - 2] >> 10);
+    schedule[i] = schedule[i - 16] + s0 + schedule[i - 7] + s1;
+  }
+
+  auto a = m_state[0];
+  auto b = m_state[1];
+  auto c = m_state[2];
+  auto d = m_state[3];
+  auto e = m_state[4];
+  auto f = m_state[5];
+  auto g = m_state[6];
+  auto h = m_state[7];
+
+  for (int i = 0; i < 64; ++i) {
+    auto s1 = rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25);
+    auto choose = (e & f) ^ (~e & g);
+    auto temp1 = h + s1 + choose + sc_roundConstants[i] + schedule[i];
+    auto s0 = rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22);
+    auto majority = (a & b) ^ (a & c) ^ (b & c);
+    auto temp2 = s0 + majority;
+
+    h = g;
+    g = f;
+    f = e;
+    e = d + temp1;
+    d = c;
+    c = b;
+    b = a;
+    a = temp1 + temp2;
+  }
+
+  m_state[0] += a;
+  m_state[1] += b;
+  m_state[2] += c;
+  m_state[3] += d;
+  m_state[4] += e;
+  m_state[5] += f;
+  m_state[6] += g;
+  m_state[7] += h;
+}
+} // namespace vfs
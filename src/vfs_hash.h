@@ -0,0 +1,31 @@
+// Part of xbox-iso-vfs
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace vfs {
+using ContentHash = std::array<uint8_t, 32>;
+
+// Incremental SHA-256, used to key file contents
+class Sha256 {
+public:
+  Sha256();
+
+  void update(const void *data, size_t length);
+  ContentHash finish();
+
+  static std::string toString(const ContentHash &hash);
+
+private:
+  void transform(const uint8_t *block);
+
+  uint32_t m_state[8];
+  uint8_t m_block[64];
+  size_t m_blockLength{0};
+  uint64_t m_totalLength{0};
+};
+} // namespace vfs
@@ -0,0 +1,157 @@
+// Part of xbox-iso-vfs
+
+#include "vfs.h"
+#include "vfs_store.h"
+
+#include <fstream>
+
+namespace vfs {
+namespace {
+// Little endian regardless of host
+//
+//   "XISOIDX" version:u8
+//   volumeModified:u64 volumeSize:u64 entryCount:u32
+//   entryCount - 1 times (the root is implied):
+//     parent:u32 startSector:u32 fileSize:u32 attributes:u8
+//     tableSector:u32 tableOffset:u32 nameLength:u8 name
+//     hasHash:u8 [hash:32]
+constexpr static char sc_indexMagic[] = "XISOIDX";
+constexpr static uint8_t sc_indexVersion = 1;
+
+constexpr static uint64_t sc_headerSize = sizeof(sc_indexMagic) - 1 + 21;
+constexpr static uint64_t sc_minimumEntrySize = 23; ///< empty name, no hash
+
+void writeValue(std::ostream &stream, uint64_t value, int size) {
+  for (int i = 0; i < size; ++i) {
+    stream.put(static_cast<char>((value >> (i * 8)) & 0xFF));
+  }
+}
+
+uint64_t readValue(std::istream &stream, int size) {
+  uint64_t value = 0;
+  for (int i = 0; i < size; ++i) {
+    value |= static_cast<uint64_t>(static_cast<uint8_t>(stream.get()))
+             << (i * 8);
+  }
+
+  return value;
+}
+} // namespace
+
+bool Container::saveIndex(const std::filesystem::path &path) const {
+  std::ofstream file(path, std::ofstream::binary | std::ofstream::out |
+                               std::ofstream::trunc);
+  if (!file.is_open()) {
+    return false;
+  }
+
+  file.write(sc_indexMagic, sizeof(sc_indexMagic) - 1);
+  writeValue(file, sc_indexVersion, 1);
+  writeValue(file, m_volumeModified, 8);
+  writeValue(file, m_volumeSize, 8);
+  writeValue(file, m_entries.size(), 4);
+
+  for (size_t i = 1; i < m_entries.size(); ++i) {
+    const auto &entry = m_entries[i];
+    const auto &name = entry.getFilename();
+
+    writeValue(file, m_parentHandles[i], 4);
+    writeValue(file, entry.getStartSector(), 4);
+    writeValue(file, entry.getFileSize(), 4);
+    writeValue(file, entry.getAttributes(), 1);
+    writeValue(file, entry.getTableSector(), 4);
+    writeValue(file, entry.getTableOffset(), 4);
+    writeValue(file, name.size(), 1);
+    file.write(name.data(), name.size());
+
+    auto hasHash = !entry.isDirectory() && i < m_contentHashes.size();
+    writeValue(file, hasHash ? 1 : 0, 1);
+    if (hasHash) {
+      file.write(reinterpret_cast<const char *>(m_contentHashes[i].data()),
+                 m_contentHashes[i].size());
+    }
+  }
+
+  return file.good();
+}
+
+SetupState Container::setupFromIndex(const std::filesystem::path &path,
+                                     ContentStore &store) {
+  std::ifstream file(path, std::ifstream::binary | std::ifstream::in);
+  if (!file.is_open()) {
+    return SetupState::ErrorFile;
+  }
+
+  char magic[sizeof(sc_indexMagic) - 1];
+  file.read(magic, sizeof(magic));
+  if (!file || std::string(magic, sizeof(magic)) != sc_indexMagic ||
+      readValue(file, 1) != sc_indexVersion) {
+    return SetupState::ErrorFormat;
+  }
+
+  auto volumeModified = readValue(file, 8);
+  auto volumeSize = readValue(file, 8);
+  auto entryCount = static_cast<size_t>(readValue(file, 4));
+
+  // The count is checked against what the file could hold before anything is
+  // sized from it
+  std::error_code errorCode;
+  auto indexSize = std::filesystem::file_size(path, errorCode);
+  if (!file || errorCode || entryCount == 0 ||
+      (static_cast<uint64_t>(entryCount) - 1) * sc_minimumEntrySize >
+          indexSize - sc_headerSize) {
+    return SetupState::ErrorFormat;
+  }
+
+  m_entries.reserve(entryCount);
+  m_parentHandles.reserve(entryCount);
+  m_foldedNameOffsets.reserve(entryCount);
+  m_foldedPathOffsets.reserve(entryCount);
+
+  xdvdfs::FileEntry root("\\");
+  registerFileEntry(root, sc_invalidHandle);
+
+  std::vector<ContentHash> hashes(entryCount);
+
+  for (size_t i = 1; i < entryCount; ++i) {
+    auto parent = static_cast<EntryHandle>(readValue(file, 4));
+    auto startSector = static_cast<uint32_t>(readValue(file, 4));
+    auto fileSize = static_cast<uint32_t>(readValue(file, 4));
+    auto attributes = static_cast<uint8_t>(readValue(file, 1));
+    auto tableSector = static_cast<uint32_t>(readValue(file, 4));
+    auto tableOffset = static_cast<uint32_t>(readValue(file, 4));
+
+    std::string name(static_cast<size_t>(readValue(file, 1)), '\0');
+    file.read(name.data(), name.size());
+
+    if (readValue(file, 1) != 0) {
+      file.read(reinterpret_cast<char *>(hashes[i].data()), hashes[i].size());
+    }
+
+    // Parents are always written before their children
+    if (!file || parent >= i) {
+      return SetupState::ErrorFormat;
+    }
+
+    registerFileEntry(xdvdfs::FileEntry(name, startSector, fileSize,
+                                        attributes, tableSector, tableOffset),
+                      parent);
+  }
+
+  m_volumeModified = volumeModified;
+  m_volumeSize = volumeSize;
+
+  buildListings();
+  buildPathIndex();
+
+  m_contentHashes = std::move(hashes);
+  m_contentStore = &store;
+
+  m_name = toWideString(path.stem());
+  m_path = path;
+
+  chargeIndexMemory();
+
+  return SetupState::Success;
+}
+} // namespace vfs
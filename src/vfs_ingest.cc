@@ -0,0 +1,1042 @@
+// Part of xbox-iso-vfs
+
+#include "vfs_ingest.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+namespace vfs {
+namespace {
+// A multiple of the sector size, so sectors never straddle two chunks
+constexpr static size_t sc_chunkSize = 1024 * 1024;
+constexpr static size_t sc_chunkSlots = 16;
+
+// Subtree offsets are 16 bit multiples of 4, which bounds a table
+constexpr static size_t sc_maxTableSize = 0x10000 * 4;
+
+constexpr static size_t sc_hashStage = 0;
+constexpr static size_t sc_structureStage = 1;
+constexpr static size_t sc_contentStage = 2;
+constexpr static size_t sc_trimStage = 3;
+constexpr static size_t sc_noDependency = ~size_t(0);
+
+using Buffer = std::shared_ptr<std::vector<char>>;
+
+struct Chunk {
+  uint64_t offset{0};
+  size_t length{0};
+  Buffer data;
+};
+
+uint64_t roundToSector(uint64_t size) {
+  return (size + xdvdfs::SECTOR_SIZE - 1) / xdvdfs::SECTOR_SIZE *
+         xdvdfs::SECTOR_SIZE;
+}
+
+// Names are written below the extraction folder as they are, so anything
+// which could leave it is skipped
+bool isSafeName(const std::string &name) {
+  return !name.empty() && name != "." && name != ".." &&
+         name.find_first_of("/\\:") == std::string::npos;
+}
+
+// Removes an output written during the ingest unless the ingest succeeds
+struct PartialOutput {
+  std::filesystem::path path;
+  bool created{false};
+  bool keep{false};
+
+  ~PartialOutput() {
+    if (created && !keep) {
+      std::error_code errorCode;
+      std::filesystem::remove(path, errorCode);
+    }
+  }
+};
+
+// Chunks published by the reader are processed by every stage in order. A
+// slot is only reused once every stage is past it, which bounds the data in
+// flight; a stage may also wait for another stage to be past a chunk
+class ChunkQueue {
+public:
+  explicit ChunkQueue(size_t stageCount)
+      : m_slots(sc_chunkSlots), m_progress(stageCount, 0) {}
+
+  // Buffer for the next chunk, or null when aborted
+  Buffer acquire() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_changed.wait(lock, [this]() {
+      return m_aborted || m_published < getMinProgress() + m_slots.size();
+    });
+    if (m_aborted) {
+      return nullptr;
+    }
+
+    // Chunks kept by a stage keep their buffer
+    auto &slot = m_slots[m_published % m_slots.size()];
+    if (!slot.data || slot.data.use_count() > 1) {
+      slot.data = std::make_shared<std::vector<char>>(sc_chunkSize);
+    }
+
+    return slot.data;
+  }
+
+  void publish(uint64_t offset, size_t length) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto &slot = m_slots[m_published % m_slots.size()];
+    slot.offset = offset;
+    slot.length = length;
+    ++m_published;
+
+    m_changed.notify_all();
+  }
+
+  void finish() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_finished = true;
+    m_changed.notify_all();
+  }
+
+  void abort() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_aborted = true;
+    m_changed.notify_all();
+  }
+
+  bool isAborted() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_aborted;
+  }
+
+  // Next chunk for the stage; false at the end of the input or when aborted
+  bool wait(size_t stage, Chunk &chunk,
+            size_t dependency = sc_noDependency) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    auto index = m_progress[stage];
+    m_changed.wait(lock, [&]() {
+      if (m_aborted || (m_finished && index >= m_published)) {
+        return true;
+      }
+      return index < m_published && (dependency == sc_noDependency ||
+                                     m_progress[dependency] > index);
+    });
+
+    if (m_aborted || index >= m_published) {
+      return false;
+    }
+
+    chunk = m_slots[index % m_slots.size()];
+    return true;
+  }
+
+  void release(size_t stage, Chunk &chunk) {
+    chunk.data.reset();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ++m_progress[stage];
+    m_changed.notify_all();
+  }
+
+private:
+  uint64_t getMinProgress() const {
+    return *std::min_element(m_progress.begin(), m_progress.end());
+  }
+
+  mutable std::mutex m_mutex;
+  std::condition_variable m_changed;
+  std::vector<Chunk> m_slots;
+  std::vector<uint64_t> m_progress; ///< chunks processed by each stage
+  uint64_t m_published{0};
+  bool m_finished{false};
+  bool m_aborted{false};
+};
+
+// Part of a directory table or a file, followed through the image as it
+// streams past
+struct Item {
+  bool isTable{false};
+  uint64_t start{0};
+  uint64_t end{0};      ///< table: whole sectors
+  uint64_t required{0}; ///< table: end of the bytes in use
+  uint64_t next{0};
+  uint32_t sector{0};      ///< table: own sector; file: listing table
+  uint32_t tableOffset{0}; ///< file: offset of the dirent
+  std::filesystem::path path;
+  bool extract{false};
+
+  std::vector<uint8_t> data;
+
+  Sha256 sha;
+  bool opened{false};
+  std::ofstream extracted;
+  std::ofstream staging;
+  std::filesystem::path stagingPath;
+  bool done{false};
+};
+
+// Feeds items the data they cover as chunks arrive. Items are only known
+// once discovered, so while more may come, chunks which could hold data for
+// them are kept, up to the buffer limit
+class ItemStage {
+public:
+  explicit ItemStage(const IngestOptions &options) : m_options(options) {}
+  virtual ~ItemStage() = default;
+
+  bool isFailed() const { return m_failed; }
+
+  // Items whose data passed before they were discovered and was no longer
+  // kept, or which the input ended before
+  size_t getUnresolvedCount() const { return m_unresolved; }
+  uint64_t getPeakBufferedBytes() const { return m_peakBufferedBytes; }
+
+protected:
+  void advanceChunk(const Chunk &chunk);
+  void advanceEnd(uint64_t inputSize);
+
+  void discover(std::unique_ptr<Item> item) {
+    m_discovered.emplace_back(std::move(item));
+  }
+
+  void startRetaining() { m_retaining = true; }
+  void stopRetaining();
+
+  virtual void consume(Item &item, const char *data, uint64_t length) = 0;
+  virtual void complete(Item &item) = 0;
+  virtual void lose(Item &item);
+
+  const IngestOptions &m_options;
+  bool m_failed{false};
+
+private:
+  void retain(const Chunk &chunk);
+  void advanceAll();
+  void schedule();
+  void advance(Item &item);
+  bool locate(uint64_t offset, const char *&data, uint64_t &available) const;
+
+  const Chunk *m_chunk{nullptr};
+  uint64_t m_inputEnd{0}; ///< end of the data read so far
+  bool m_endOfInput{false};
+
+  bool m_retaining{false};
+  std::map<uint64_t, Chunk> m_retained;
+  uint64_t m_retainedBytes{0};
+  uint64_t m_peakBufferedBytes{0};
+  size_t m_unresolved{0};
+
+  std::multimap<uint64_t, std::unique_ptr<Item>> m_waiting; ///< by start
+  std::vector<std::unique_ptr<Item>> m_active;
+  std::vector<std::unique_ptr<Item>> m_discovered;
+};
+
+void ItemStage::advanceChunk(const Chunk &chunk) {
+  m_chunk = &chunk;
+  m_inputEnd = chunk.offset + chunk.length;
+
+  if (m_retaining) {
+    retain(chunk);
+  }
+
+  while (!m_waiting.empty() && m_waiting.begin()->first < m_inputEnd) {
+    m_active.emplace_back(std::move(m_waiting.begin()->second));
+    m_waiting.erase(m_waiting.begin());
+  }
+
+  advanceAll();
+  m_chunk = nullptr;
+}
+
+void ItemStage::advanceEnd(uint64_t inputSize) {
+  m_inputEnd = inputSize;
+  m_endOfInput = true;
+
+  for (auto &item : m_waiting) {
+    m_active.emplace_back(std::move(item.second));
+  }
+  m_waiting.clear();
+
+  advanceAll();
+
+  m_retained.clear();
+}
+
+void ItemStage::stopRetaining() {
+  m_retaining = false;
+  m_retained.clear();
+  m_retainedBytes = 0;
+}
+
+void ItemStage::retain(const Chunk &chunk) {
+  m_retained[chunk.offset] = chunk;
+  m_retainedBytes += chunk.length;
+
+  m_peakBufferedBytes = std::max(m_peakBufferedBytes, m_retainedBytes);
+
+  // Oldest first; anything needed from it later is unresolved
+  while (m_retainedBytes > m_options.bufferLimit && m_retained.size() > 1) {
+    m_retainedBytes -= m_retained.begin()->second.length;
+    m_retained.erase(m_retained.begin());
+  }
+}
+
+void ItemStage::advanceAll() {
+  for (;;) {
+    schedule();
+
+    for (auto &item : m_active) {
+      if (!item->done) {
+        advance(*item);
+      }
+    }
+
+    m_active.erase(std::remove_if(m_active.begin(), m_active.end(),
+                                  [](const std::unique_ptr<Item> &item) {
+                                    return item->done;
+                                  }),
+                   m_active.end());
+
+    if (m_discovered.empty()) {
+      return;
+    }
+  }
+}
+
+void ItemStage::schedule() {
+  for (auto &item : m_discovered) {
+    if (item->start < m_inputEnd || m_endOfInput) {
+      m_active.emplace_back(std::move(item));
+    } else {
+      auto start = item->start;
+      m_waiting.emplace(start, std::move(item));
+    }
+  }
+
+  m_discovered.clear();
+}
+
+void ItemStage::advance(Item &item) {
+  auto limit = std::min(item.end, m_inputEnd);
+
+  while (item.next < limit && !m_failed) {
+    const char *data;
+    uint64_t available;
+    if (!locate(item.next, data, available)) {
+      lose(item);
+      return;
+    }
+
+    consume(item, data, std::min(available, limit - item.next));
+  }
+
+  if (m_failed) {
+    return;
+  }
+
+  // A table at the very end of a trimmed image may stop short of its sector
+  if (item.next == item.end ||
+      (m_endOfInput && item.isTable && item.next >= item.required)) {
+    item.done = true;
+    complete(item);
+  } else if (m_endOfInput) {
+    lose(item);
+  }
+}
+
+bool ItemStage::locate(uint64_t offset, const char *&data,
+                       uint64_t &available) const {
+  auto find = [&](const Chunk &chunk) {
+    if (offset < chunk.offset || offset >= chunk.offset + chunk.length) {
+      return false;
+    }
+
+    data = chunk.data->data() + (offset - chunk.offset);
+    available = chunk.offset + chunk.length - offset;
+    return true;
+  };
+
+  if (m_chunk && find(*m_chunk)) {
+    return true;
+  }
+
+  auto it = m_retained.find(offset - offset % sc_chunkSize);
+  return it != m_retained.end() && find(it->second);
+}
+
+void ItemStage::lose(Item &item) {
+  item.done = true;
+  ++m_unresolved;
+}
+
+// Hashes each file into the store, and extracts it, as its data streams
+// past. Runs on its own thread behind the structure stage, which hands over
+// the files as their tables are read
+class ContentStage : public ItemStage {
+public:
+  ContentStage(ContentStore &store, const IngestOptions &options,
+               IngestReport &report)
+      : ItemStage(options), m_store(store), m_report(report) {}
+
+  // Called from the structure stage
+  void post(std::unique_ptr<Item> item);
+
+  // The structure stage must be past the chunk. tablesDone is read before
+  // the call: once set, every file has been posted and no chunk need be kept
+  void process(const Chunk &chunk, bool hasPartition, bool tablesDone);
+  void finish(uint64_t inputSize);
+
+  // Hash of the file listed at the dirent
+  const ContentHash *getHash(uint32_t tableSector, uint32_t tableOffset) const;
+
+protected:
+  void consume(Item &item, const char *data, uint64_t length) override;
+  void complete(Item &item) override;
+  void lose(Item &item) override;
+
+private:
+  void takePosted();
+  void openOutputs(Item &item);
+
+  ContentStore &m_store;
+  IngestReport &m_report;
+
+  std::mutex m_postedMutex;
+  std::vector<std::unique_ptr<Item>> m_posted;
+
+  std::map<std::pair<uint32_t, uint32_t>, ContentHash> m_hashes;
+};
+
+void ContentStage::post(std::unique_ptr<Item> item) {
+  std::lock_guard<std::mutex> lock(m_postedMutex);
+  m_posted.emplace_back(std::move(item));
+}
+
+void ContentStage::takePosted() {
+  std::vector<std::unique_ptr<Item>> posted;
+  {
+    std::lock_guard<std::mutex> lock(m_postedMutex);
+    posted.swap(m_posted);
+  }
+
+  for (auto &item : posted) {
+    discover(std::move(item));
+  }
+}
+
+void ContentStage::process(const Chunk &chunk, bool hasPartition,
+                           bool tablesDone) {
+  takePosted();
+
+  // Files start within the game partition, so nothing before it is kept
+  if (hasPartition && !tablesDone) {
+    startRetaining();
+  }
+
+  advanceChunk(chunk);
+
+  if (tablesDone) {
+    stopRetaining();
+  }
+}
+
+void ContentStage::finish(uint64_t inputSize) {
+  takePosted();
+  advanceEnd(inputSize);
+}
+
+void ContentStage::consume(Item &item, const char *data, uint64_t length) {
+  if (!item.opened) {
+    openOutputs(item);
+  }
+
+  item.sha.update(data, length);
+  item.staging.write(data, static_cast<std::streamsize>(length));
+  if (item.extract) {
+    item.extracted.write(data, static_cast<std::streamsize>(length));
+  }
+
+  item.next += length;
+}
+
+void ContentStage::openOutputs(Item &item) {
+  item.opened = true;
+
+  item.stagingPath = m_store.createStagingFile();
+  if (!item.stagingPath.empty()) {
+    item.staging.open(item.stagingPath, std::ofstream::binary |
+                                            std::ofstream::out |
+                                            std::ofstream::trunc);
+  }
+  if (!item.staging.is_open()) {
+    m_failed = true;
+  }
+
+  if (item.extract) {
+    item.extracted.open(m_options.extractPath / item.path,
+                        std::ofstream::binary | std::ofstream::out |
+                            std::ofstream::trunc);
+    if (!item.extracted.is_open()) {
+      m_failed = true;
+    }
+  }
+}
+
+void ContentStage::complete(Item &item) {
+  if (!item.opened) {
+    openOutputs(item);
+  }
+
+  auto hash = item.sha.finish();
+  m_hashes[{item.sector, item.tableOffset}] = hash;
+  ++m_report.files;
+
+  item.staging.close();
+  if (item.extract) {
+    item.extracted.close();
+    if (!item.extracted) {
+      m_failed = true;
+      return;
+    }
+    ++m_report.extractedFiles;
+  }
+
+  if (!item.staging) {
+    m_failed = true;
+    return;
+  }
+
+  // Same as importImage: keep the copy only if the store does not have it
+  std::error_code errorCode;
+  auto size = item.end - item.start;
+
+  if (m_store.contains(hash)) {
+    std::filesystem::remove(item.stagingPath, errorCode);
+    m_report.sharedBytes += size;
+    return;
+  }
+
+  auto objectPath = m_store.getObjectPath(hash);
+  std::filesystem::create_directories(objectPath.parent_path(), errorCode);
+  std::filesystem::rename(item.stagingPath, objectPath, errorCode);
+  if (errorCode) {
+    m_failed = true;
+    return;
+  }
+
+  ++m_report.newObjects;
+  m_report.newBytes += size;
+}
+
+void ContentStage::lose(Item &item) {
+  ItemStage::lose(item);
+
+  std::error_code errorCode;
+  if (item.opened) {
+    item.staging.close();
+    std::filesystem::remove(item.stagingPath, errorCode);
+  }
+  if (item.extracted.is_open()) {
+    item.extracted.close();
+    std::filesystem::remove(m_options.extractPath / item.path, errorCode);
+  }
+}
+
+const ContentHash *ContentStage::getHash(uint32_t tableSector,
+                                         uint32_t tableOffset) const {
+  auto it = m_hashes.find({tableSector, tableOffset});
+  return it != m_hashes.end() ? &it->second : nullptr;
+}
+
+// Follows the image structure as it streams past. Directory tables are
+// collected and parsed as they complete, which reveals where further tables
+// and the files are; files are handed to the content stage. Data which could
+// belong to a table not known yet is kept until every table has been read
+class StructureStage : public ItemStage {
+public:
+  StructureStage(ContentStage &content, const IngestOptions &options,
+                 IngestReport &report)
+      : ItemStage(options), m_content(content), m_report(report) {}
+
+  void process(const Chunk &chunk);
+
+  // Completes what the remaining data allows once the input has ended
+  void finish(uint64_t inputSize);
+
+  bool isFormatError() const { return m_formatError; }
+
+  // Read by the trimmed copy and content stages while this one runs ahead
+  bool hasPartition() const { return m_found; }
+  uint64_t getPartitionOffset() const { return m_partitionOffset; }
+  bool areTablesDone() const { return m_tablesDone; }
+  uint64_t getUsedEnd() const { return m_usedEnd; }
+
+  // Volume descriptor and tables as resident extents of a stream without
+  // parts, to index the image from
+  std::unique_ptr<xdvdfs::Stream> makeTableStream() const;
+
+protected:
+  void consume(Item &item, const char *data, uint64_t length) override;
+  void complete(Item &item) override;
+  void lose(Item &item) override;
+
+private:
+  void findVolumeDescriptor(const Chunk &chunk);
+
+  void discoverTable(uint32_t sector, uint32_t size,
+                     const std::filesystem::path &path, bool extract);
+  void discoverFile(const xdvdfs::FileEntry &entry,
+                    const std::filesystem::path &path, bool extract);
+
+  ContentStage &m_content;
+  IngestReport &m_report;
+
+  std::atomic<bool> m_found{false};
+  std::atomic<uint64_t> m_partitionOffset{0};
+  std::atomic<bool> m_tablesDone{false};
+  std::atomic<uint64_t> m_usedEnd{0}; ///< end of the last sector in use
+  size_t m_candidate{0};
+  bool m_formatError{false};
+  std::vector<uint8_t> m_volumeDescriptor;
+
+  size_t m_pendingTables{0};
+
+  std::map<uint32_t, std::vector<uint8_t>> m_tables; ///< by sector
+  std::set<uint32_t> m_seenTables;
+};
+
+void StructureStage::process(const Chunk &chunk) {
+  if (!m_found && !m_formatError) {
+    findVolumeDescriptor(chunk);
+  }
+
+  advanceChunk(chunk);
+
+  // Nothing new can be discovered; data is only needed as it arrives
+  if (m_found && m_pendingTables == 0 && !m_tablesDone) {
+    stopRetaining();
+    m_tablesDone = true;
+  }
+}
+
+void StructureStage::finish(uint64_t inputSize) {
+  if (!m_found) {
+    m_formatError = true;
+    return;
+  }
+
+  advanceEnd(inputSize);
+  m_tablesDone = true;
+}
+
+void StructureStage::findVolumeDescriptor(const Chunk &chunk) {
+  const uint64_t candidates[] = {0, xdvdfs::GAME_PARTITION_OFFSET};
+
+  while (m_candidate < std::size(candidates)) {
+    auto partitionOffset = candidates[m_candidate];
+    auto offset = partitionOffset + static_cast<uint64_t>(
+                                        xdvdfs::VOLUME_DESCRIPTOR_SECTOR) *
+                                        xdvdfs::SECTOR_SIZE;
+
+    if (offset + xdvdfs::SECTOR_SIZE > chunk.offset + chunk.length) {
+      return;
+    }
+
+    ++m_candidate;
+    if (offset < chunk.offset) {
+      continue;
+    }
+
+    auto sector = reinterpret_cast<const uint8_t *>(chunk.data->data()) +
+                  (offset - chunk.offset);
+
+    xdvdfs::VolumeDescriptor vd;
+    vd.parse(sector);
+    if (!vd.validate()) {
+      continue;
+    }
+
+    m_volumeDescriptor.assign(sector, sector + xdvdfs::SECTOR_SIZE);
+    m_partitionOffset = partitionOffset;
+    m_usedEnd = offset + xdvdfs::SECTOR_SIZE;
+    startRetaining();
+
+    discoverTable(vd.getRootDirTableSector(), vd.getRootDirTableSize(), {},
+                  !m_options.extractPath.empty());
+    m_found = true;
+    return;
+  }
+
+  m_formatError = true;
+}
+
+void StructureStage::consume(Item &item, const char *data, uint64_t length) {
+  std::memcpy(item.data.data() + (item.next - item.start), data, length);
+  item.next += length;
+}
+
+void StructureStage::complete(Item &item) {
+  --m_pendingTables;
+
+  const auto table = item.data.data();
+  const auto tableSize = item.data.size();
+
+  // Same walk as Container::buildFromTable, which bounds a cyclic table
+  auto remaining = tableSize / xdvdfs::FileEntry::NAME_OFFSET;
+  std::vector<size_t> pending{0};
+
+  xdvdfs::FileEntry entry;
+  while (!pending.empty() && remaining-- > 0) {
+    auto offset = pending.back();
+    pending.pop_back();
+
+    if (!entry.parse(table, tableSize, offset, item.sector)) {
+      continue;
+    }
+
+    if (entry.hasRightChild()) {
+      pending.push_back(entry.getRightOffset());
+    }
+    if (entry.hasLeftChild()) {
+      pending.push_back(entry.getLeftOffset());
+    }
+
+    const auto &name = entry.getFilename();
+    auto path = item.path / name;
+    auto extract = item.extract && isSafeName(name);
+
+    if (!entry.isDirectory()) {
+      discoverFile(entry, path, extract);
+      continue;
+    }
+
+    ++m_report.directories;
+
+    if (extract) {
+      std::error_code errorCode;
+      std::filesystem::create_directories(m_options.extractPath / path,
+                                          errorCode);
+    }
+
+    discoverTable(entry.getStartSector(), entry.getFileSize(), path, extract);
+  }
+
+  m_tables[item.sector] = std::move(item.data);
+}
+
+void StructureStage::lose(Item &item) {
+  ItemStage::lose(item);
+  --m_pendingTables;
+}
+
+void StructureStage::discoverTable(uint32_t sector, uint32_t size,
+                                   const std::filesystem::path &path,
+                                   bool extract) {
+  // Tables are never shared by well formed images
+  if (size == 0 || !m_seenTables.insert(sector).second) {
+    return;
+  }
+
+  auto item = std::make_unique<Item>();
+  item->isTable = true;
+  item->sector = sector;
+  item->start = m_partitionOffset +
+                static_cast<uint64_t>(sector) * xdvdfs::SECTOR_SIZE;
+  item->end = item->start + std::min<uint64_t>(roundToSector(size),
+                                               sc_maxTableSize);
+  item->required = item->start + std::min<uint64_t>(size, sc_maxTableSize);
+  item->next = item->start;
+  item->path = path;
+  item->extract = extract;
+  item->data.resize(static_cast<size_t>(item->end - item->start), 0);
+
+  m_usedEnd = std::max<uint64_t>(m_usedEnd, item->end);
+
+  ++m_pendingTables;
+  discover(std::move(item));
+}
+
+void StructureStage::discoverFile(const xdvdfs::FileEntry &entry,
+                                  const std::filesystem::path &path,
+                                  bool extract) {
+  auto item = std::make_unique<Item>();
+  item->sector = entry.getTableSector();
+  item->tableOffset = entry.getTableOffset();
+  item->start = m_partitionOffset +
+                static_cast<uint64_t>(entry.getStartSector()) *
+                    xdvdfs::SECTOR_SIZE;
+  item->end = item->start + entry.getFileSize();
+  item->next = item->start;
+  item->path = path;
+  item->extract = extract;
+
+  m_usedEnd = std::max<uint64_t>(m_usedEnd,
+                                 m_partitionOffset +
+                                     roundToSector(item->end -
+                                                   m_partitionOffset));
+
+  m_content.post(std::move(item));
+}
+
+std::unique_ptr<xdvdfs::Stream> StructureStage::makeTableStream() const {
+  auto stream = std::make_unique<xdvdfs::Stream>();
+
+  uint64_t totalSize = m_volumeDescriptor.size();
+  for (const auto &table : m_tables) {
+    totalSize += table.second.size();
+  }
+
+  std::shared_ptr<char> memory(new char[totalSize],
+                               std::default_delete<char[]>());
+
+  auto destination = memory.get();
+  auto addExtent = [&](uint64_t sector, const std::vector<uint8_t> &data) {
+    std::memcpy(destination, data.data(), data.size());
+    stream->m_residentExtents.push_back(
+        {m_partitionOffset + sector * xdvdfs::SECTOR_SIZE, data.size(),
+         destination});
+    destination += data.size();
+  };
+
+  addExtent(xdvdfs::VOLUME_DESCRIPTOR_SECTOR, m_volumeDescriptor);
+  for (const auto &table : m_tables) {
+    addExtent(table.first, table.second);
+  }
+
+  std::sort(stream->m_residentExtents.begin(),
+            stream->m_residentExtents.end(),
+            [](const xdvdfs::ResidentExtent &a,
+               const xdvdfs::ResidentExtent &b) { return a.offset < b.offset; });
+
+  stream->m_residentMemory = std::move(memory);
+  return stream;
+}
+
+} // namespace
+
+IngestReport ingestImage(std::istream &input, ContentStore &store,
+                         const IngestOptions &options) {
+  IngestReport report;
+
+  std::error_code errorCode;
+  if (!options.extractPath.empty()) {
+    std::filesystem::create_directories(options.extractPath, errorCode);
+  }
+
+  auto trim = !options.trimmedPath.empty();
+  ChunkQueue queue(trim ? 4 : 3);
+
+  ContentStage content(store, options, report);
+  StructureStage structure(content, options, report);
+
+  // Whole image hash
+  std::thread hashThread([&]() {
+    Sha256 sha;
+
+    Chunk chunk;
+    while (queue.wait(sc_hashStage, chunk)) {
+      sha.update(chunk.data->data(), chunk.length);
+      queue.release(sc_hashStage, chunk);
+    }
+
+    report.imageHash = sha.finish();
+  });
+
+  std::thread structureThread([&]() {
+    Chunk chunk;
+    while (queue.wait(sc_structureStage, chunk)) {
+      structure.process(chunk);
+      queue.release(sc_structureStage, chunk);
+
+      if (structure.isFailed() || structure.isFormatError()) {
+        queue.abort();
+        return;
+      }
+    }
+  });
+
+  // File contents, hashed into the store and extracted behind the structure
+  std::thread contentThread([&]() {
+    Chunk chunk;
+    while (queue.wait(sc_contentStage, chunk, sc_structureStage)) {
+      auto tablesDone = structure.areTablesDone();
+      content.process(chunk, structure.hasPartition(), tablesDone);
+      queue.release(sc_contentStage, chunk);
+
+      if (content.isFailed()) {
+        queue.abort();
+        return;
+      }
+    }
+  });
+
+  // Game partition up to the last sector in use. Until every table is read
+  // the end is not known, so the file is cut back afterwards
+  bool trimFailed = false;
+  uint64_t trimWritten = 0;
+  PartialOutput trimmed{options.trimmedPath};
+  std::thread trimThread;
+  if (trim) {
+    trimThread = std::thread([&]() {
+      std::ofstream file(options.trimmedPath, std::ofstream::binary |
+                                                  std::ofstream::out |
+                                                  std::ofstream::trunc);
+      if (!file.is_open()) {
+        trimFailed = true;
+        queue.abort();
+        return;
+      }
+      trimmed.created = true;
+
+      Chunk chunk;
+      while (queue.wait(sc_trimStage, chunk, sc_structureStage)) {
+        if (structure.hasPartition()) {
+          auto partitionOffset = structure.getPartitionOffset();
+          auto end = chunk.offset + chunk.length;
+          if (structure.areTablesDone()) {
+            end = std::min(end, structure.getUsedEnd());
+          }
+
+          auto begin = std::max(chunk.offset, partitionOffset);
+          if (begin < end) {
+            file.write(chunk.data->data() + (begin - chunk.offset),
+                       static_cast<std::streamsize>(end - begin));
+            trimWritten = end - partitionOffset;
+          }
+        }
+
+        queue.release(sc_trimStage, chunk);
+      }
+
+      file.close();
+      if (!file) {
+        trimFailed = true;
+        queue.abort();
+      }
+    });
+  }
+
+  // The reader: the only access to the input
+  uint64_t offset = 0;
+  for (;;) {
+    auto buffer = queue.acquire();
+    if (!buffer) {
+      break;
+    }
+
+    input.read(buffer->data(), sc_chunkSize);
+    auto length = static_cast<size_t>(input.gcount());
+    if (length == 0) {
+      break;
+    }
+
+    queue.publish(offset, length);
+    offset += length;
+
+    if (length < sc_chunkSize) {
+      break;
+    }
+  }
+  queue.finish();
+
+  hashThread.join();
+  structureThread.join();
+  contentThread.join();
+  if (trimThread.joinable()) {
+    trimThread.join();
+  }
+
+  report.bytesRead = offset;
+
+  auto collectCounts = [&]() {
+    report.unresolvedEntries =
+        structure.getUnresolvedCount() + content.getUnresolvedCount();
+    report.peakBufferedBytes = std::max(structure.getPeakBufferedBytes(),
+                                        content.getPeakBufferedBytes());
+  };
+  collectCounts();
+
+  if (input.bad() || offset == 0) {
+    return report;
+  }
+
+  if (structure.isFormatError()) {
+    report.state = SetupState::ErrorFormat;
+    return report;
+  }
+
+  report.state = SetupState::Success;
+
+  if (queue.isAborted() || structure.isFailed() || content.isFailed()) {
+    return report;
+  }
+
+  // Files listed by tables completed here are posted before content finishes
+  structure.finish(offset);
+  if (structure.isFormatError()) {
+    report.state = SetupState::ErrorFormat;
+    return report;
+  }
+  content.finish(offset);
+  collectCounts();
+
+  if (trim) {
+    report.trimmedSize = std::min(trimWritten, structure.getUsedEnd() -
+                                                   structure.getPartitionOffset());
+    std::filesystem::resize_file(options.trimmedPath, report.trimmedSize,
+                                 errorCode);
+    trimFailed = trimFailed || errorCode;
+  }
+
+  if (structure.isFailed() || content.isFailed() || trimFailed ||
+      report.unresolvedEntries > 0) {
+    return report;
+  }
+
+  // Index the image from its tables alone
+  Container container;
+  if (container.setupFromStream(structure.makeTableStream(),
+                                fromWideString(options.name + L".iso"),
+                                offset) != SetupState::Success) {
+    report.state = SetupState::ErrorFormat;
+    return report;
+  }
+
+  std::vector<ContentHash> hashes(container.getEntryCount());
+  for (size_t handle = 1; handle < hashes.size(); ++handle) {
+    auto entry = container.getEntry(handle);
+    if (entry->isDirectory()) {
+      continue;
+    }
+
+    auto hash = content.getHash(entry->getTableSector(),
+                                entry->getTableOffset());
+    if (!hash) {
+      ++report.unresolvedEntries;
+      continue;
+    }
+    hashes[handle] = *hash;
+  }
+
+  if (report.unresolvedEntries > 0) {
+    return report;
+  }
+
+  container.setContentHashes(std::move(hashes));
+
+  report.indexPath = store.saveIndex(container, options.name, report.renamed);
+  report.success = !report.indexPath.empty();
+  trimmed.keep = report.success;
+
+  return report;
+}
+} // namespace vfs
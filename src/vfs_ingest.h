@@ -0,0 +1,60 @@
+// Part of xbox-iso-vfs
+
+#pragma once
+
+#include "vfs.h"
+#include "vfs_hash.h"
+#include "vfs_store.h"
+
+#include <filesystem>
+#include <istream>
+#include <string>
+
+namespace vfs {
+struct IngestOptions {
+  std::wstring name; ///< index name in the store
+
+  std::filesystem::path extractPath; ///< extract the files below, if set
+  std::filesystem::path trimmedPath; ///< write a trimmed copy, if set;
+                                     ///< removed if the ingest fails
+
+  // Data kept while directory tables are still to come, for files and tables
+  // placed before the table listing them
+  uint64_t bufferLimit{256 * 1024 * 1024};
+};
+
+struct IngestReport {
+  SetupState state{SetupState::ErrorFile};
+  bool success{false};
+
+  uint64_t bytesRead{0};
+  ContentHash imageHash{}; ///< SHA-256 of every byte read
+
+  size_t files{0};
+  size_t directories{0};
+  size_t newObjects{0};
+  uint64_t newBytes{0};    ///< bytes added to the store
+  uint64_t sharedBytes{0}; ///< bytes already present in the store
+  size_t extractedFiles{0};
+
+  uint64_t trimmedSize{0};
+  uint64_t peakBufferedBytes{0};
+
+  // Entries whose data passed before their table was read and was no
+  // longer buffered; the ingest fails when there are any
+  size_t unresolvedEntries{0};
+
+  std::filesystem::path indexPath;
+  bool renamed{false}; ///< the name was taken by a different image
+};
+
+// Reads an image exactly once, front to back, so input may be a pipe. The
+// chunks read are fanned out to stages running in parallel: the whole image
+// hash; the volume descriptor and directory tables; behind those, each file
+// hashed into the store (and extracted) as its data streams past; and the
+// trimmed copy of the game partition, which ends at the last sector in use.
+// Once the image is read the container index is saved to the store, ready
+// to be mounted with setupFromIndex
+IngestReport ingestImage(std::istream &input, ContentStore &store,
+                         const IngestOptions &options);
+} // namespace vfs
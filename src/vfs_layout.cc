@@ -0,0 +1,267 @@
+// Part of xbox-iso-vfs
+
+#include "vfs_layout.h"
+
+#include <algorithm>
+#include <deque>
+
+namespace vfs {
+namespace {
+constexpr static uint32_t sc_copyBufferSize = 1024 * 1024;
+
+struct DirectoryTable {
+  Container::EntryHandle handle; ///< owning directory; 0 for the root
+  uint32_t sector;
+  uint32_t size;
+  uint32_t newSector{0};
+};
+
+uint32_t sectorCount(uint64_t size) {
+  return static_cast<uint32_t>((size + xdvdfs::SECTOR_SIZE - 1) /
+                               xdvdfs::SECTOR_SIZE);
+}
+
+void storeLittleEndian32(char *destination, uint32_t value) {
+  xdvdfs::storeLittleEndian32(reinterpret_cast<uint8_t *>(destination), value);
+}
+
+bool readPartition(xdvdfs::Stream &stream, uint64_t offset, char *buffer,
+                   size_t length) {
+  // Tables and header sectors are always within the image
+  return stream.readAt(buffer, length,
+                       static_cast<uint64_t>(stream.m_offset) + offset) ==
+         length;
+}
+} // namespace
+
+bool AccessTrace::open(const std::filesystem::path &path, size_t entryCount) {
+  m_file.open(path, std::ofstream::out | std::ofstream::trunc);
+  if (!m_file.is_open()) {
+    return false;
+  }
+
+  m_seen = std::make_unique<std::atomic<bool>[]>(entryCount);
+  m_entryCount = entryCount;
+
+  return true;
+}
+
+void AccessTrace::record(const Container &container,
+                         Container::EntryHandle handle) {
+  // Only the first read of each entry takes the lock
+  if (handle >= m_entryCount || m_seen[handle].exchange(true)) {
+    return;
+  }
+
+  auto path = container.getPath(handle);
+
+  std::lock_guard<std::mutex> lock(m_fileMutex);
+  m_file << path << std::endl;
+}
+
+bool readAccessOrder(const std::filesystem::path &path,
+                     std::vector<std::string> &order) {
+  order.clear();
+
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    return false;
+  }
+
+  std::string line;
+  while (std::getline(file, line)) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+
+    if (line.empty() || line.front() == '#') {
+      continue;
+    }
+
+    order.emplace_back(line);
+  }
+
+  return !file.bad();
+}
+
+LayoutReport rewriteImage(const Container &container,
+                          const std::vector<std::string> &accessOrder,
+                          const std::filesystem::path &output) {
+  LayoutReport report;
+
+  if (!container.getFileStream()) {
+    return report;
+  }
+
+  auto &stream = *container.getFileStream();
+  const auto &vd = container.getVolumeDescriptor();
+
+  // Collect the directory tables breadth first so sibling tables end up
+  // next to each other, and every file on the way
+  std::vector<DirectoryTable> tables;
+  std::vector<Container::EntryHandle> files;
+
+  tables.push_back({0, vd.getRootDirTableSector(), vd.getRootDirTableSize()});
+
+  std::deque<Container::EntryHandle> pending{0};
+  while (!pending.empty()) {
+    auto directory = pending.front();
+    pending.pop_front();
+
+    for (auto child : container.getFolderList(container.getPath(directory))) {
+      auto entry = container.getEntry(child);
+
+      if (!entry->isDirectory()) {
+        files.emplace_back(child);
+      } else if (entry->getFileSize() != 0) {
+        tables.push_back(
+            {child, entry->getStartSector(), entry->getFileSize()});
+        pending.emplace_back(child);
+      }
+    }
+  }
+
+  // Files from the access order first, then the rest in on-disc order
+  std::vector<Container::EntryHandle> ordered;
+  std::vector<bool> placed(container.getEntryCount(), false);
+
+  for (const auto &path : accessOrder) {
+    auto handle = container.lookupPath(path);
+    if (handle == Container::sc_invalidHandle) {
+      report.unmatchedPaths.emplace_back(path);
+      continue;
+    }
+    if (placed[handle] || container.getEntry(handle)->isDirectory()) {
+      continue;
+    }
+
+    placed[handle] = true;
+    ordered.emplace_back(handle);
+  }
+
+  report.orderedFiles = ordered.size();
+
+  std::sort(files.begin(), files.end(),
+            [&container](Container::EntryHandle a, Container::EntryHandle b) {
+              return container.getEntry(a)->getStartSector() <
+                     container.getEntry(b)->getStartSector();
+            });
+
+  for (auto handle : files) {
+    if (!placed[handle]) {
+      placed[handle] = true;
+      ordered.emplace_back(handle);
+    }
+  }
+
+  // Assign the new layout, starting after the volume descriptor
+  std::vector<uint32_t> newSectors(container.getEntryCount(), 0);
+  for (size_t i = 1; i < newSectors.size(); ++i) {
+    newSectors[i] = container.getEntry(i)->getStartSector();
+  }
+
+  uint32_t cursor = xdvdfs::VOLUME_DESCRIPTOR_SECTOR + 1;
+
+  for (auto &table : tables) {
+    table.newSector = cursor;
+    newSectors[table.handle] = cursor;
+    cursor += sectorCount(table.size);
+  }
+
+  for (auto handle : ordered) {
+    newSectors[handle] = cursor;
+    cursor += sectorCount(container.getEntry(handle)->getFileSize());
+  }
+
+  std::ofstream file(output, std::ofstream::binary | std::ofstream::out |
+                                 std::ofstream::trunc);
+  if (!file.is_open()) {
+    return report;
+  }
+
+  // Header sectors are kept as they are
+  std::vector<char> buffer(xdvdfs::SECTOR_SIZE *
+                           (xdvdfs::VOLUME_DESCRIPTOR_SECTOR + 1));
+  if (!readPartition(stream, 0, buffer.data(), buffer.size())) {
+    return report;
+  }
+
+  auto vdSector =
+      buffer.data() + xdvdfs::VOLUME_DESCRIPTOR_SECTOR * xdvdfs::SECTOR_SIZE;
+  storeLittleEndian32(vdSector + xdvdfs::VolumeDescriptor::ROOT_SECTOR_OFFSET,
+                      tables.front().newSector);
+
+  file.write(buffer.data(), buffer.size());
+
+  // Directory tables, with the start sector of every entry patched
+  for (const auto &table : tables) {
+    buffer.assign(static_cast<size_t>(sectorCount(table.size)) *
+                      xdvdfs::SECTOR_SIZE,
+                  0);
+
+    if (!readPartition(stream,
+                       static_cast<uint64_t>(table.sector) *
+                           xdvdfs::SECTOR_SIZE,
+                       buffer.data(), table.size)) {
+      return report;
+    }
+
+    auto listing = container.getFolderList(container.getPath(table.handle));
+    for (auto child : listing) {
+      auto entry = container.getEntry(child);
+      auto offset = entry->getTableOffset() +
+                    xdvdfs::FileEntry::START_SECTOR_OFFSET;
+
+      if (entry->getTableSector() != table.sector ||
+          offset + 4 > buffer.size()) {
+        continue;
+      }
+
+      storeLittleEndian32(buffer.data() + offset, newSectors[child]);
+    }
+
+    file.seekp(static_cast<std::streamoff>(table.newSector) *
+                   xdvdfs::SECTOR_SIZE,
+               std::ofstream::beg);
+    file.write(buffer.data(), buffer.size());
+  }
+
+  // File data
+  buffer.resize(sc_copyBufferSize);
+
+  for (auto handle : ordered) {
+    auto entry = container.getEntry(handle);
+
+    file.seekp(static_cast<std::streamoff>(newSectors[handle]) *
+                   xdvdfs::SECTOR_SIZE,
+               std::ofstream::beg);
+
+    for (uint32_t done = 0; done < entry->getFileSize();) {
+      auto length =
+          entry->read(stream, buffer.data(), sc_copyBufferSize, done);
+      if (length == 0) {
+        return report;
+      }
+
+      file.write(buffer.data(), length);
+      done += length;
+    }
+  }
+
+  // Pad the final file out to a whole sector
+  report.outputSize = static_cast<uint64_t>(cursor) * xdvdfs::SECTOR_SIZE;
+
+  file.seekp(0, std::ofstream::end);
+  if (static_cast<uint64_t>(file.tellp()) < report.outputSize) {
+    file.seekp(static_cast<std::streamoff>(report.outputSize - 1),
+               std::ofstream::beg);
+    file.put('\0');
+  }
+
+  report.totalFiles = ordered.size();
+  report.directoryTables = tables.size();
+  report.success = file.good();
+
+  return report;
+}
+} // namespace vfs
@@ -0,0 +1,54 @@
+// Part of xbox-iso-vfs
+
+#pragma once
+
+#include "vfs.h"
+
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace vfs {
+// Appends the path of each file to a trace the first time it is read, giving
+// the access order of a boot or play session
+class AccessTrace {
+public:
+  bool open(const std::filesystem::path &path, size_t entryCount);
+
+  void record(const Container &container, Container::EntryHandle handle);
+
+private:
+  std::unique_ptr<std::atomic<bool>[]> m_seen;
+  size_t m_entryCount{0};
+
+  std::mutex m_fileMutex;
+  std::ofstream m_file;
+};
+
+// Reads a trace (or hand written boot profile) of one path per line. Paths
+// may use either separator, with or without the leading root. Blank lines
+// and lines starting with # are ignored. Fails if the file cannot be read
+bool readAccessOrder(const std::filesystem::path &path,
+                     std::vector<std::string> &order);
+
+struct LayoutReport {
+  bool success{false};
+  size_t orderedFiles{0}; ///< files placed from the access order
+  size_t totalFiles{0};
+  std::vector<std::string> unmatchedPaths; ///< access order lines not found
+  size_t directoryTables{0};
+  uint64_t outputSize{0};
+};
+
+// Writes a copy of the game partition with the directory tables packed after
+// the volume descriptor, followed by the files in access order and then the
+// remaining files in their original order. Start sectors in the tables and
+// the root table location in the volume descriptor are rewritten to match
+LayoutReport rewriteImage(const Container &container,
+                          const std::vector<std::string> &accessOrder,
+                          const std::filesystem::path &output);
+} // namespace vfs
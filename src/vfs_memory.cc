@@ -0,0 +1,366 @@
+// Part of xbox-iso-vfs
+
+#include "vfs_memory.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+namespace vfs {
+namespace {
+constexpr static auto sc_pressurePollInterval = std::chrono::milliseconds(500);
+
+#if defined(__linux__)
+constexpr static const char *sc_pressurePath = "/proc/pressure/memory";
+
+// Share of the last 10 seconds some task stalled on memory, in percent
+bool readMemoryPressure(double &average) {
+  auto file = std::fopen(sc_pressurePath, "r");
+  if (!file) {
+    return false;
+  }
+
+  auto result = std::fscanf(file, "some avg10=%lf", &average) == 1;
+  std::fclose(file);
+
+  return result;
+}
+#endif
+} // namespace
+
+MemoryGovernor::~MemoryGovernor() {
+  // The pressure thread requests reclaims, so it goes first
+  m_pressureRunning = false;
+  if (m_pressureThread.joinable()) {
+    m_pressureThread.join();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stopping = true;
+  }
+  m_wake.notify_all();
+
+  if (m_reclaimThread.joinable()) {
+    m_reclaimThread.join();
+  }
+}
+
+MemoryGovernor &MemoryGovernor::getDefault() {
+  static MemoryGovernor governor;
+  return governor;
+}
+
+const char *MemoryGovernor::getCategoryName(MemoryCategory category) {
+  switch (category) {
+  case MemoryCategory::Prefetch:
+    return "prefetch";
+  case MemoryCategory::Cache:
+    return "cache";
+  case MemoryCategory::Index:
+    return "index";
+  case MemoryCategory::Pinned:
+    return "pinned";
+  }
+
+  return "unknown";
+}
+
+void MemoryGovernor::setBudget(uint64_t bytes) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  m_budget = bytes;
+  if (m_budget > 0 && m_used > m_budget) {
+    requestReclaim(m_used - m_budget);
+  }
+}
+
+MemoryGovernor::ConsumerId MemoryGovernor::addConsumer(MemoryCategory category,
+                                                       Reclaimer reclaimer) {
+  auto consumer = std::make_shared<Consumer>();
+  consumer->category = category;
+  consumer->reclaimer = std::move(reclaimer);
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  auto id = m_nextId++;
+  m_consumers.emplace(id, std::move(consumer));
+
+  return id;
+}
+
+void MemoryGovernor::removeConsumer(ConsumerId id) {
+  std::shared_ptr<Consumer> consumer;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_consumers.find(id);
+    if (it == m_consumers.end()) {
+      return;
+    }
+    consumer = it->second;
+  }
+
+  // Only a consumer with a reclaimer can be in use by a reclaim pass
+  std::unique_lock<std::recursive_mutex> reclaimLock(m_reclaimMutex,
+                                                     std::defer_lock);
+  if (consumer->reclaimer) {
+    reclaimLock.lock();
+  }
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  updateUsage(*consumer, 0);
+  consumer->removed = true;
+  m_consumers.erase(id);
+}
+
+void MemoryGovernor::charge(ConsumerId id, int64_t bytes) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  auto it = m_consumers.find(id);
+  if (it == m_consumers.end()) {
+    return;
+  }
+
+  auto &consumer = *it->second;
+  auto used = static_cast<int64_t>(consumer.used) + bytes;
+  updateUsage(consumer, static_cast<uint64_t>(std::max<int64_t>(used, 0)));
+}
+
+void MemoryGovernor::setUsage(ConsumerId id, uint64_t bytes) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  auto it = m_consumers.find(id);
+  if (it != m_consumers.end()) {
+    updateUsage(*it->second, bytes);
+  }
+}
+
+void MemoryGovernor::updateUsage(Consumer &consumer, uint64_t used) {
+  auto category = static_cast<size_t>(consumer.category);
+
+  m_used = m_used - consumer.used + used;
+  m_categoryUsed[category] = m_categoryUsed[category] - consumer.used + used;
+  consumer.used = used;
+
+  if (m_budget > 0 && m_used > m_budget) {
+    requestReclaim(m_used - m_budget);
+  }
+}
+
+void MemoryGovernor::requestReclaim(uint64_t bytes) {
+  // Late charges during shutdown must not start a thread that is never joined
+  if (m_stopping) {
+    return;
+  }
+
+  m_requested = std::max(m_requested, bytes);
+
+  if (!m_reclaimThread.joinable()) {
+    startReclaimThread();
+  }
+  m_wake.notify_one();
+}
+
+void MemoryGovernor::startReclaimThread() {
+  m_reclaimThread = std::thread([this]() { reclaimLoop(); });
+}
+
+uint64_t MemoryGovernor::reclaim(uint64_t bytes) {
+  std::lock_guard<std::recursive_mutex> reclaimLock(m_reclaimMutex);
+
+  uint64_t freed = 0;
+
+  for (size_t category = 0;
+       category < static_cast<size_t>(MemoryCategory::Pinned) && freed < bytes;
+       ++category) {
+    // Largest consumers of the category first
+    std::vector<std::pair<uint64_t, std::shared_ptr<Consumer>>> candidates;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      for (const auto &consumer : m_consumers) {
+        if (static_cast<size_t>(consumer.second->category) == category &&
+            consumer.second->reclaimer) {
+          candidates.emplace_back(consumer.second->used, consumer.second);
+        }
+      }
+    }
+
+    std::sort(candidates.begin(), candidates.end(),
+              [](const auto &a, const auto &b) { return a.first > b.first; });
+
+    for (const auto &candidate : candidates) {
+      if (freed >= bytes) {
+        break;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (candidate.second->removed) {
+          continue;
+        }
+      }
+
+      auto released = candidate.second->reclaimer(bytes - freed);
+      freed += released;
+
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_categoryReclaimed[category] += released;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  ++m_reclaimPasses;
+
+  return freed;
+}
+
+void MemoryGovernor::reclaimLoop() {
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  for (;;) {
+    m_wake.wait(lock, [this]() { return m_stopping || m_requested > 0; });
+    if (m_stopping) {
+      return;
+    }
+
+    auto bytes = m_requested;
+    m_requested = 0;
+
+    lock.unlock();
+    reclaim(bytes);
+    lock.lock();
+  }
+}
+
+void MemoryGovernor::onPressure() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  ++m_pressureEvents;
+
+  auto pinned = m_categoryUsed[static_cast<size_t>(MemoryCategory::Pinned)];
+  auto reclaimable = m_used - pinned;
+  if (reclaimable > 0) {
+    requestReclaim(reclaimable / 4 + 1);
+  }
+}
+
+bool MemoryGovernor::startPressureMonitor() {
+  if (m_pressureRunning.exchange(true)) {
+    return true;
+  }
+
+#if defined(__linux__)
+  double average;
+  if (!readMemoryPressure(average)) {
+    m_pressureRunning = false;
+    return false;
+  }
+#elif !defined(_WIN32)
+  m_pressureRunning = false;
+  return false;
+#endif
+
+  m_pressureThread = std::thread([this]() { pressureLoop(); });
+  return true;
+}
+
+#ifdef _WIN32
+void MemoryGovernor::pressureLoop() {
+  auto notification =
+      CreateMemoryResourceNotification(LowMemoryResourceNotification);
+  if (!notification) {
+    m_pressureRunning = false;
+    return;
+  }
+
+  while (m_pressureRunning) {
+    auto interval = static_cast<DWORD>(sc_pressurePollInterval.count());
+    if (WaitForSingleObject(notification, interval) != WAIT_OBJECT_0) {
+      continue;
+    }
+
+    // Stays signalled while memory is low; give the reclaim time to land
+    onPressure();
+    std::this_thread::sleep_for(sc_pressurePollInterval * 2);
+  }
+
+  CloseHandle(notification);
+}
+#elif defined(__linux__)
+void MemoryGovernor::pressureLoop() {
+  // A trigger wakes us on 100 ms of stalls within any second. Creating one
+  // needs privileges on older kernels, so fall back to sampling the averages
+  static const char sc_trigger[] = "some 100000 1000000";
+
+  auto descriptor = open(sc_pressurePath, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (descriptor >= 0 &&
+      write(descriptor, sc_trigger, sizeof(sc_trigger)) >= 0) {
+    while (m_pressureRunning) {
+      pollfd event{descriptor, POLLPRI, 0};
+
+      auto result = poll(&event, 1, sc_pressurePollInterval.count());
+      if (result < 0 && errno != EINTR) {
+        break;
+      }
+      if (result > 0 && (event.revents & POLLERR)) {
+        break;
+      }
+      if (result > 0 && (event.revents & POLLPRI)) {
+        onPressure();
+      }
+    }
+
+    close(descriptor);
+    return;
+  }
+
+  if (descriptor >= 0) {
+    close(descriptor);
+  }
+
+  constexpr static double sc_pressureThreshold = 10.0;
+
+  while (m_pressureRunning) {
+    std::this_thread::sleep_for(sc_pressurePollInterval);
+
+    double average;
+    if (readMemoryPressure(average) && average >= sc_pressureThreshold) {
+      onPressure();
+    }
+  }
+}
+#else
+void MemoryGovernor::pressureLoop() {}
+#endif
+
+MemoryGovernor::Stats MemoryGovernor::getStats() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  Stats stats;
+  stats.budget = m_budget;
+  stats.used = m_used;
+  std::copy(std::begin(m_categoryUsed), std::end(m_categoryUsed),
+            stats.categoryUsed);
+  std::copy(std::begin(m_categoryReclaimed), std::end(m_categoryReclaimed),
+            stats.categoryReclaimed);
+  stats.reclaimPasses = m_reclaimPasses;
+  stats.pressureEvents = m_pressureEvents;
+  stats.pressureMonitor = m_pressureRunning;
+
+  return stats;
+}
+} // namespace vfs
@@ -0,0 +1,110 @@
+// Part of xbox-iso-vfs
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace vfs {
+// In reclaim order; pinned memory is accounted for but never reclaimed
+enum class MemoryCategory { Prefetch, Cache, Index, Pinned };
+
+constexpr static size_t sc_memoryCategoryCount = 4;
+
+// Single authority over the memory held for images in this process.
+// Consumers report what they hold and may offer a reclaimer. When the total
+// passes the budget, or the system reports memory pressure, memory is taken
+// back from speculative prefetch first, then cold cache, then idle indexes
+class MemoryGovernor {
+public:
+  using ConsumerId = size_t;
+
+  // Frees up to the given number of bytes and returns how many it freed,
+  // reporting the change with charge as usual. Called on the governor's
+  // thread with no governor lock held
+  using Reclaimer = std::function<uint64_t(uint64_t bytes)>;
+
+  struct Stats {
+    uint64_t budget{0}; ///< 0 when unlimited
+    uint64_t used{0};
+    uint64_t categoryUsed[sc_memoryCategoryCount]{};
+    uint64_t categoryReclaimed[sc_memoryCategoryCount]{};
+    uint64_t reclaimPasses{0};
+    uint64_t pressureEvents{0};
+    bool pressureMonitor{false};
+  };
+
+  MemoryGovernor() = default;
+  ~MemoryGovernor();
+
+  MemoryGovernor(const MemoryGovernor &) = delete;
+  MemoryGovernor &operator=(const MemoryGovernor &) = delete;
+
+  static MemoryGovernor &getDefault();
+  static const char *getCategoryName(MemoryCategory category);
+
+  void setBudget(uint64_t bytes);
+
+  ConsumerId addConsumer(MemoryCategory category, Reclaimer reclaimer = {});
+
+  // A consumer with a reclaimer must not be removed while holding a lock its
+  // reclaimer takes; removal waits for a running reclaim pass to finish
+  void removeConsumer(ConsumerId id);
+
+  void charge(ConsumerId id, int64_t bytes);
+  void setUsage(ConsumerId id, uint64_t bytes);
+
+  // Reclaims up to bytes in category order, on the calling thread
+  uint64_t reclaim(uint64_t bytes);
+
+  // Watches for system memory pressure (PSI on Linux, the low memory
+  // notification on Windows) and reclaims a quarter of the reclaimable
+  // memory each time it is reported
+  bool startPressureMonitor();
+
+  Stats getStats() const;
+
+private:
+  struct Consumer {
+    MemoryCategory category;
+    Reclaimer reclaimer;
+    uint64_t used{0};
+    bool removed{false};
+  };
+
+  void updateUsage(Consumer &consumer, uint64_t used);
+  void requestReclaim(uint64_t bytes);
+  void startReclaimThread();
+  void reclaimLoop();
+  void pressureLoop();
+  void onPressure();
+
+  mutable std::mutex m_mutex;
+  std::map<ConsumerId, std::shared_ptr<Consumer>> m_consumers;
+  ConsumerId m_nextId{1};
+  uint64_t m_budget{0};
+  uint64_t m_used{0};
+  uint64_t m_categoryUsed[sc_memoryCategoryCount]{};
+  uint64_t m_categoryReclaimed[sc_memoryCategoryCount]{};
+  uint64_t m_reclaimPasses{0};
+  uint64_t m_pressureEvents{0};
+
+  // Held for a whole reclaim pass; recursive so a reclaimer may remove
+  // consumers, directly or by destroying what they belong to
+  std::recursive_mutex m_reclaimMutex;
+
+  std::condition_variable m_wake;
+  uint64_t m_requested{0}; ///< bytes asked of the reclaim thread
+  bool m_stopping{false};
+  std::thread m_reclaimThread;
+
+  std::atomic<bool> m_pressureRunning{false};
+  std::thread m_pressureThread;
+};
+} // namespace vfs
@@ -2,12 +2,16 @@
 
 #include "vfs_operations.h"
 
+#include <cstring>
 #include <filesystem>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <string>
 
 #include "vfs.h"
+#include "vfs_layout.h"
+#include "vfs_volume.h"
 
 namespace vfs {
 // TODO implement something relevant?
@@ -15,11 +19,35 @@ namespace vfs {
 constexpr static const DWORD sc_volumeSerialNumber = 0x11115555;
 
 namespace utils {
-static vfs::Container *getContext(PDOKAN_FILE_INFO dokanfileinfo) {
-  return reinterpret_cast<vfs::Container *>(
+static vfs::Volume *getVolume(PDOKAN_FILE_INFO dokanfileinfo) {
+  return reinterpret_cast<vfs::Volume *>(
       dokanfileinfo->DokanOptions->GlobalContext);
 }
 
+using PinnedContainer = std::shared_ptr<vfs::Container>;
+
+// Container pinned when the handle was opened, so an image swap never
+// changes what an open handle reads
+static PinnedContainer getContext(PDOKAN_FILE_INFO dokanfileinfo) {
+  if (dokanfileinfo->Context) {
+    return *reinterpret_cast<PinnedContainer *>(dokanfileinfo->Context);
+  }
+
+  return getVolume(dokanfileinfo)->acquire();
+}
+
+static void pinContext(PDOKAN_FILE_INFO dokanfileinfo,
+                       PinnedContainer container) {
+  delete reinterpret_cast<PinnedContainer *>(dokanfileinfo->Context);
+  dokanfileinfo->Context =
+      reinterpret_cast<ULONG64>(new PinnedContainer(std::move(container)));
+}
+
+static void unpinContext(PDOKAN_FILE_INFO dokanfileinfo) {
+  delete reinterpret_cast<PinnedContainer *>(dokanfileinfo->Context);
+  dokanfileinfo->Context = 0;
+}
+
 void LlongToDwLowHigh(const LONGLONG &v, DWORD &low, DWORD &hight) {
   hight = v >> 32;
   low = static_cast<DWORD>(v);
@@ -38,7 +66,8 @@ static NTSTATUS DOKAN_CALLBACK vfs_createfile(
     LPCWSTR filename, PDOKAN_IO_SECURITY_CONTEXT, ACCESS_MASK desiredaccess,
     ULONG fileattributes, ULONG, ULONG createdisposition, ULONG createoptions,
     PDOKAN_FILE_INFO dokanfileinfo) {
-  auto vfsContext = utils::getContext(dokanfileinfo);
+  // New opens always see the current image
+  auto vfsContext = utils::getVolume(dokanfileinfo)->acquire();
 
   ACCESS_MASK generic_desiredaccess;
   DWORD creation_disposition;
@@ -102,23 +131,34 @@ static NTSTATUS DOKAN_CALLBACK vfs_createfile(
     return STATUS_OBJECT_NAME_COLLISION;
   }
 
+  utils::pinContext(dokanfileinfo, std::move(vfsContext));
+
   return STATUS_SUCCESS;
 }
 
+static void DOKAN_CALLBACK vfs_closefile(LPCWSTR,
+                                         PDOKAN_FILE_INFO dokanfileinfo) {
+  utils::unpinContext(dokanfileinfo);
+}
+
 static NTSTATUS DOKAN_CALLBACK vfs_readfile(LPCWSTR filename, LPVOID buffer,
                                             DWORD bufferlength,
                                             LPDWORD readlength, LONGLONG offset,
                                             PDOKAN_FILE_INFO dokanfileinfo) {
   auto vfsContext = utils::getContext(dokanfileinfo);
 
-  auto e = vfsContext->getEntry(filename);
+  auto handle = vfsContext->getHandle(filename);
+  auto e = vfsContext->getEntry(handle);
   if (!e) {
     return STATUS_OBJECT_NAME_NOT_FOUND;
   }
 
   if (!e->isDirectory()) {
-    auto stream = vfsContext->getFileStream();
-    *readlength = e->read(*stream, buffer, bufferlength, offset);
+    if (auto trace = vfsContext->getAccessTrace()) {
+      trace->record(*vfsContext, handle);
+    }
+
+    *readlength = vfsContext->readEntry(handle, buffer, bufferlength, offset);
   } else {
     *readlength = 0;
   }
@@ -164,41 +204,42 @@ static NTSTATUS DOKAN_CALLBACK vfs_findfiles(LPCWSTR filename,
                                              PDOKAN_FILE_INFO dokanfileinfo) {
   auto vfsContext = utils::getContext(dokanfileinfo);
 
-  auto folderContents = vfsContext->getFolderList(filename);
-
   WIN32_FIND_DATAW findData;
   ZeroMemory(&findData, sizeof(WIN32_FIND_DATAW));
 
-  for (const auto &f : folderContents) {
-    auto e = vfsContext->getEntry(f);
+  vfs::ListingPage page;
+  do {
+    page = vfsContext->getListing(filename, page.next);
 
-    auto name = e->getFilename();
-    auto name_str = std::wstring(name.begin(), name.end());
+    for (size_t i = 0; i < page.count; ++i) {
+      const auto &record = page.records[i];
 
-    if (name_str.length() > MAX_PATH) {
-      continue;
-    }
+      if (record.nameLength >= MAX_PATH) {
+        continue;
+      }
 
-    std::copy(name_str.begin(), name_str.end(), std::begin(findData.cFileName));
-    findData.cFileName[name_str.length()] = L'\0';
+      // Copy including the null terminator
+      std::memcpy(findData.cFileName, vfsContext->getListingName(record),
+                  (record.nameLength + 1) * sizeof(wchar_t));
 
-    DWORD attribs = FILE_ATTRIBUTE_READONLY;
-    if (e->isDirectory()) {
-      attribs |= FILE_ATTRIBUTE_DIRECTORY;
+      DWORD attribs = 0;
+      if (record.attributes & xdvdfs::FileEntry::FILE_READONLY) {
+        attribs |= FILE_ATTRIBUTE_READONLY;
+      }
+      if (record.attributes & xdvdfs::FileEntry::FILE_DIRECTORY) {
+        attribs |= FILE_ATTRIBUTE_DIRECTORY;
+      }
+      findData.dwFileAttributes = attribs;
+
+      utils::LlongToFileTime(record.modified, findData.ftCreationTime);
+      utils::LlongToFileTime(record.modified, findData.ftLastAccessTime);
+      utils::LlongToFileTime(record.modified, findData.ftLastWriteTime);
+      utils::LlongToDwLowHigh(record.fileSize, findData.nFileSizeLow,
+                              findData.nFileSizeHigh);
+
+      fill_finddata(&findData, dokanfileinfo);
     }
-    findData.dwFileAttributes = attribs;
-
-    utils::LlongToFileTime(vfsContext->getVolumeModified(),
-                           findData.ftCreationTime);
-    utils::LlongToFileTime(vfsContext->getVolumeModified(),
-                           findData.ftLastAccessTime);
-    utils::LlongToFileTime(vfsContext->getVolumeModified(),
-                           findData.ftLastWriteTime);
-    utils::LlongToDwLowHigh(e->getFileSize(), findData.nFileSizeLow,
-                            findData.nFileSizeHigh);
-
-    fill_finddata(&findData, dokanfileinfo);
-  }
+  } while (!page.complete);
 
   return STATUS_SUCCESS;
 }
@@ -234,10 +275,29 @@ static NTSTATUS DOKAN_CALLBACK vfs_getvolumeinformation(
   return STATUS_SUCCESS;
 }
 
+void setupOptions(DOKAN_OPTIONS &dokanOptions, Volume &volume,
+                  const std::wstring &mountPoint, bool debugMode) {
+  ZeroMemory(&dokanOptions, sizeof(DOKAN_OPTIONS));
+
+  dokanOptions.Version = DOKAN_VERSION;
+  dokanOptions.SingleThread = FALSE;
+  dokanOptions.Timeout = 0;
+  dokanOptions.GlobalContext = reinterpret_cast<ULONG64>(&volume);
+  dokanOptions.MountPoint = mountPoint.c_str();
+  dokanOptions.Options |= DOKAN_OPTION_ALT_STREAM;
+  dokanOptions.Options |= DOKAN_OPTION_WRITE_PROTECT;
+  dokanOptions.Options |= DOKAN_OPTION_CURRENT_SESSION;
+
+  if (debugMode) {
+    dokanOptions.Options |= DOKAN_OPTION_STDERR | DOKAN_OPTION_DEBUG;
+  }
+}
+
 void setup(DOKAN_OPERATIONS &dokanOperations) {
   // Implements only a subset of operations
 
   dokanOperations.ZwCreateFile = vfs_createfile;
+  dokanOperations.CloseFile = vfs_closefile;
   dokanOperations.ReadFile = vfs_readfile;
   dokanOperations.GetFileInformation = vfs_getfileInformation;
   dokanOperations.FindFiles = vfs_findfiles;
@@ -4,6 +4,15 @@
 
 #include <dokan/dokan.h>
 
+#include <string>
+
 namespace vfs {
+class Volume;
+
 void setup(DOKAN_OPERATIONS &dokanOperations);
-}
+
+// Options for mounting the volume read-only at the mount point. Both must
+// outlive the mount
+void setupOptions(DOKAN_OPTIONS &dokanOptions, Volume &volume,
+                  const std::wstring &mountPoint, bool debugMode);
+} // namespace vfs
@@ -0,0 +1,336 @@
+// Part of xbox-iso-vfs
+
+#include "vfs_resident.h"
+
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace vfs {
+namespace {
+constexpr static uint64_t sc_loadChunkSize = 8 * 1024 * 1024;
+constexpr static uint32_t sc_sampleReadSize = 4096;
+constexpr static size_t sc_sampleReadCount = 4096;
+
+struct Range {
+  uint64_t offset;
+  uint64_t size;
+};
+
+#ifdef _WIN32
+bool enableLockMemoryPrivilege() {
+  HANDLE token;
+  if (!OpenProcessToken(GetCurrentProcess(),
+                        TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+    return false;
+  }
+
+  TOKEN_PRIVILEGES privileges{};
+  privileges.PrivilegeCount = 1;
+  privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+  auto result = LookupPrivilegeValueW(nullptr, SE_LOCK_MEMORY_NAME,
+                                      &privileges.Privileges[0].Luid) &&
+                AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr,
+                                      nullptr) &&
+                GetLastError() == ERROR_SUCCESS;
+
+  CloseHandle(token);
+  return result;
+}
+
+std::shared_ptr<char> allocate(uint64_t size, HugePages &hugePages) {
+  auto release = [](char *memory) { VirtualFree(memory, 0, MEM_RELEASE); };
+
+  // Large pages need SeLockMemoryPrivilege which is only granted by policy
+  auto largePageSize = GetLargePageMinimum();
+  if (largePageSize != 0 && enableLockMemoryPrivilege()) {
+    auto rounded = (size + largePageSize - 1) / largePageSize * largePageSize;
+
+    auto memory = VirtualAlloc(nullptr, rounded,
+                               MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                               PAGE_READWRITE);
+    if (memory) {
+      hugePages = HugePages::Explicit;
+      return std::shared_ptr<char>(static_cast<char *>(memory), release);
+    }
+  }
+
+  auto memory =
+      VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+  if (!memory) {
+    return nullptr;
+  }
+
+  hugePages = HugePages::None;
+  return std::shared_ptr<char>(static_cast<char *>(memory), release);
+}
+#else
+std::shared_ptr<char> allocate(uint64_t size, HugePages &hugePages) {
+  constexpr static uint64_t sc_hugePageSize = 2 * 1024 * 1024;
+
+  auto rounded = (size + sc_hugePageSize - 1) / sc_hugePageSize *
+                 sc_hugePageSize;
+  auto release = [rounded](char *memory) { munmap(memory, rounded); };
+
+#ifdef MAP_HUGETLB
+  auto huge = mmap(nullptr, rounded, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (huge != MAP_FAILED) {
+    hugePages = HugePages::Explicit;
+    return std::shared_ptr<char>(static_cast<char *>(huge), release);
+  }
+#endif
+
+  // No reserved huge pages; fall back to transparent huge pages
+  auto memory = mmap(nullptr, rounded, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    return nullptr;
+  }
+
+  hugePages = HugePages::None;
+#ifdef MADV_HUGEPAGE
+  if (madvise(memory, rounded, MADV_HUGEPAGE) == 0) {
+    hugePages = HugePages::Transparent;
+  }
+#endif
+
+  return std::shared_ptr<char>(static_cast<char *>(memory), release);
+}
+#endif
+
+void collectFiles(const Container &container, Container::EntryHandle handle,
+                  std::vector<Container::EntryHandle> &files) {
+  auto entry = container.getEntry(handle);
+  if (!entry->isDirectory()) {
+    files.emplace_back(handle);
+    return;
+  }
+
+  for (auto child : container.getFolderList(container.getPath(handle))) {
+    collectFiles(container, child, files);
+  }
+}
+
+std::vector<Range> mergeRanges(std::vector<Range> ranges) {
+  std::sort(ranges.begin(), ranges.end(),
+            [](const Range &a, const Range &b) { return a.offset < b.offset; });
+
+  std::vector<Range> merged;
+  for (const auto &range : ranges) {
+    if (!merged.empty() &&
+        range.offset <= merged.back().offset + merged.back().size) {
+      auto end = std::max(merged.back().offset + merged.back().size,
+                          range.offset + range.size);
+      merged.back().size = end - merged.back().offset;
+    } else {
+      merged.emplace_back(range);
+    }
+  }
+
+  return merged;
+}
+} // namespace
+
+ResidencyReport makeResident(Container &container,
+                             const std::vector<std::string> &paths,
+                             unsigned threadCount) {
+  ResidencyReport report;
+
+  // Images served from a content store have no stream to load from
+  auto stream = container.getFileStream();
+  if (!stream) {
+    return report;
+  }
+
+  auto partitionOffset = static_cast<uint64_t>(stream->m_offset);
+
+  // Work out which parts of the partition to load
+  std::vector<Container::EntryHandle> files;
+  std::vector<Range> ranges;
+
+  if (paths.empty()) {
+    collectFiles(container, 0, files);
+
+    if (container.getVolumeSize() > partitionOffset) {
+      ranges.push_back({0, container.getVolumeSize() - partitionOffset});
+    }
+  } else {
+    for (const auto &path : paths) {
+      auto handle = container.getHandle(path);
+      if (handle != Container::sc_invalidHandle) {
+        collectFiles(container, handle, files);
+      }
+    }
+
+    std::sort(files.begin(), files.end());
+    files.erase(std::unique(files.begin(), files.end()), files.end());
+
+    for (auto handle : files) {
+      auto entry = container.getEntry(handle);
+      if (entry->getFileSize() == 0) {
+        continue;
+      }
+
+      // Whole sectors, so neighbouring files merge into one extent
+      auto size = (static_cast<uint64_t>(entry->getFileSize()) +
+                   xdvdfs::SECTOR_SIZE - 1) /
+                  xdvdfs::SECTOR_SIZE * xdvdfs::SECTOR_SIZE;
+      auto offset = static_cast<uint64_t>(entry->getStartSector()) *
+                    xdvdfs::SECTOR_SIZE;
+      ranges.push_back({offset, size});
+    }
+
+    ranges = mergeRanges(std::move(ranges));
+  }
+
+  uint64_t totalSize = 0;
+  for (const auto &range : ranges) {
+    totalSize += range.size;
+  }
+
+  if (totalSize == 0) {
+    return report;
+  }
+
+  auto startTime = std::chrono::steady_clock::now();
+
+  auto memory = allocate(totalSize, report.hugePages);
+  if (!memory) {
+    return report;
+  }
+
+  // Lay the extents out back to back and split them into chunks which the
+  // workers claim in order, keeping each worker's reads sequential
+  struct Chunk {
+    uint64_t offset;
+    uint64_t size;
+    char *destination;
+  };
+
+  std::vector<xdvdfs::ResidentExtent> extents;
+  std::vector<Chunk> chunks;
+
+  auto destination = memory.get();
+  for (const auto &range : ranges) {
+    extents.push_back({range.offset, range.size, destination});
+
+    for (uint64_t done = 0; done < range.size; done += sc_loadChunkSize) {
+      auto size = std::min(sc_loadChunkSize, range.size - done);
+      chunks.push_back({range.offset + done, size, destination + done});
+    }
+
+    destination += range.size;
+  }
+
+  if (threadCount == 0) {
+    threadCount = std::max(1u, std::thread::hardware_concurrency());
+  }
+  threadCount = std::min<unsigned>(threadCount,
+                                   static_cast<unsigned>(chunks.size()));
+
+  auto imageSize = stream->getSize();
+
+  std::atomic<size_t> nextChunk{0};
+  std::atomic<bool> failed{false};
+
+  auto worker = [&]() {
+    // Direct reads are positional and can share the stream; otherwise each
+    // worker opens its own handles so the reads are not serialized
+    xdvdfs::Stream ownStream;
+    auto reader = stream;
+    if (!stream->isDirect()) {
+      if (!ownStream.open(stream->getPartPaths(), false)) {
+        failed = true;
+        return;
+      }
+      reader = &ownStream;
+    }
+
+    // Only the final sector of the image may be short, and the rest of it
+    // stays zeroed. Anything else failed to read, direct or not
+    for (auto index = nextChunk++; index < chunks.size() && !failed;
+         index = nextChunk++) {
+      const auto &chunk = chunks[index];
+      auto position = partitionOffset + chunk.offset;
+      auto expected = std::min(
+          chunk.size, imageSize > position ? imageSize - position : 0);
+
+      if (chunk.size - expected >= xdvdfs::SECTOR_SIZE ||
+          reader->readAt(chunk.destination, chunk.size, position) !=
+              expected) {
+        failed = true;
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned i = 0; i < threadCount; ++i) {
+    workers.emplace_back(worker);
+  }
+
+  for (auto &thread : workers) {
+    thread.join();
+  }
+
+  if (failed) {
+    return report;
+  }
+
+  // Pinned in the governor's accounting until the stream lets go of it
+  auto &governor = MemoryGovernor::getDefault();
+  auto memoryId = governor.addConsumer(MemoryCategory::Pinned);
+  governor.setUsage(memoryId, totalSize);
+
+  auto pinned = memory.get();
+  stream->m_residentExtents = std::move(extents);
+  stream->m_residentMemory = std::shared_ptr<char>(
+      pinned, [memory = std::move(memory), memoryId](char *) mutable {
+        memory.reset();
+        MemoryGovernor::getDefault().removeConsumer(memoryId);
+      });
+
+  report.loadTime = std::chrono::steady_clock::now() - startTime;
+  report.residentBytes = totalSize;
+  report.extentCount = stream->m_residentExtents.size();
+  report.fileCount = files.size();
+  report.success = true;
+
+  // Sample the read path the frontend will use
+  std::vector<Container::EntryHandle> samples;
+  for (auto handle : files) {
+    if (container.getEntry(handle)->getFileSize() > 0) {
+      samples.emplace_back(handle);
+    }
+  }
+
+  if (!samples.empty()) {
+    std::mt19937 random(0);
+    std::vector<char> buffer(sc_sampleReadSize);
+
+    auto sampleStart = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < sc_sampleReadCount; ++i) {
+      auto entry = container.getEntry(samples[random() % samples.size()]);
+      auto offset = random() % entry->getFileSize();
+
+      entry->read(*stream, buffer.data(), sc_sampleReadSize, offset);
+    }
+
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - sampleStart;
+    report.readLatencyNs = elapsed.count() / sc_sampleReadCount;
+  }
+
+  return report;
+}
+} // namespace vfs
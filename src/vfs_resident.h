@@ -0,0 +1,34 @@
+// Part of xbox-iso-vfs
+
+#pragma once
+
+#include "vfs.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace vfs {
+enum class HugePages {
+  None,
+  Transparent, ///< kernel was advised to back the memory with huge pages
+  Explicit,    ///< memory was allocated from the large/huge page pool
+};
+
+struct ResidencyReport {
+  bool success{false};
+  uint64_t residentBytes{0};
+  size_t extentCount{0};
+  size_t fileCount{0};
+  HugePages hugePages{HugePages::None};
+  std::chrono::duration<double> loadTime{};
+  double readLatencyNs{0}; ///< mean of sampled 4 KiB reads after loading
+};
+
+// Loads the whole game partition (when paths is empty) or the files below the
+// given paths into anonymous memory. Must be called before the container is
+// shared, after which any read falling inside a loaded extent is a memcpy
+ResidencyReport makeResident(Container &container,
+                             const std::vector<std::string> &paths,
+                             unsigned threadCount = 0);
+} // namespace vfs
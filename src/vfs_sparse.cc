@@ -0,0 +1,172 @@
+// Part of xbox-iso-vfs
+
+#include "vfs_sparse.h"
+
+#include <algorithm>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <winioctl.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace vfs {
+namespace {
+constexpr static uint64_t sc_copyChunkSize = 4 * 1024 * 1024;
+} // namespace
+
+#ifdef _WIN32
+SparseFile::~SparseFile() {
+  if (m_handle) {
+    CloseHandle(m_handle);
+  }
+}
+
+bool SparseFile::create(const std::filesystem::path &path, uint64_t size,
+                        bool &sparse) {
+  auto handle = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0,
+                            nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL,
+                            nullptr);
+  if (handle == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+
+  m_handle = handle;
+
+  // Without the sparse flag, extending the file allocates all of it
+  DWORD returned = 0;
+  sparse = DeviceIoControl(m_handle, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0,
+                           &returned, nullptr) != 0;
+
+  LARGE_INTEGER end;
+  end.QuadPart = static_cast<LONGLONG>(size);
+  return SetFilePointerEx(m_handle, end, nullptr, FILE_BEGIN) &&
+         SetEndOfFile(m_handle);
+}
+
+bool SparseFile::write(uint64_t offset, const char *data, uint64_t length) {
+  OVERLAPPED overlapped{};
+  overlapped.Offset = static_cast<DWORD>(offset);
+  overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+  DWORD written = 0;
+  return WriteFile(m_handle, data, static_cast<DWORD>(length), &written,
+                   &overlapped) &&
+         written == length;
+}
+
+uint64_t SparseFile::getAllocatedSize(const std::filesystem::path &path) {
+  DWORD high = 0;
+  auto low = GetCompressedFileSizeW(path.c_str(), &high);
+  if (low == INVALID_FILE_SIZE && GetLastError() != NO_ERROR) {
+    return 0;
+  }
+
+  return (static_cast<uint64_t>(high) << 32) | low;
+}
+#else
+SparseFile::~SparseFile() {
+  if (m_descriptor >= 0) {
+    close(m_descriptor);
+  }
+}
+
+bool SparseFile::create(const std::filesystem::path &path, uint64_t size,
+                        bool &sparse) {
+  m_descriptor = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (m_descriptor < 0) {
+    return false;
+  }
+
+  // Holes are the default for a truncated file on any modern file system
+  sparse = true;
+  return ftruncate(m_descriptor, static_cast<off_t>(size)) == 0;
+}
+
+bool SparseFile::write(uint64_t offset, const char *data, uint64_t length) {
+  uint64_t done = 0;
+
+  while (done < length) {
+    auto result = pwrite(m_descriptor, data + done, length - done,
+                         static_cast<off_t>(offset + done));
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      return false;
+    }
+
+    done += static_cast<uint64_t>(result);
+  }
+
+  return true;
+}
+
+uint64_t SparseFile::getAllocatedSize(const std::filesystem::path &path) {
+  struct stat status;
+  if (stat(path.c_str(), &status) != 0) {
+    return 0;
+  }
+
+  return static_cast<uint64_t>(status.st_blocks) * 512;
+}
+#endif
+
+SparseCopyReport sparseCopy(const Container &container,
+                            const std::filesystem::path &output) {
+  SparseCopyReport report;
+
+  auto stream = container.getFileStream();
+  if (!stream || container.getUsedSectors().empty()) {
+    return report;
+  }
+
+  auto imageSize = container.getVolumeSize();
+  auto partitionOffset = static_cast<uint64_t>(stream->m_offset);
+
+  {
+    SparseFile file;
+    if (!file.create(output, imageSize, report.sparse)) {
+      return report;
+    }
+
+    std::vector<char> buffer(sc_copyChunkSize);
+
+    for (const auto &range : container.getUsedSectors()) {
+      auto start = partitionOffset +
+                   static_cast<uint64_t>(range.sector) * xdvdfs::SECTOR_SIZE;
+      if (start >= imageSize) {
+        continue;
+      }
+
+      // Trimmed images may end part way through the final sector
+      auto end = std::min(imageSize,
+                          start + static_cast<uint64_t>(range.count) *
+                                      xdvdfs::SECTOR_SIZE);
+
+      for (auto offset = start; offset < end; offset += sc_copyChunkSize) {
+        auto length = std::min(sc_copyChunkSize, end - offset);
+
+        if (stream->readAt(buffer.data(), length, offset) != length ||
+            !file.write(offset, buffer.data(), length)) {
+          return report;
+        }
+
+        report.copiedBytes += length;
+      }
+    }
+  }
+
+  report.imageSize = imageSize;
+  report.allocatedSize = SparseFile::getAllocatedSize(output);
+  report.success = true;
+
+  return report;
+}
+} // namespace vfs
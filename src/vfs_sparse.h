@@ -0,0 +1,49 @@
+// Part of xbox-iso-vfs
+
+#pragma once
+
+#include "vfs.h"
+
+#include <filesystem>
+
+namespace vfs {
+// Output file created at its full size as a single hole, which data is then
+// written into at any offset. Writes are positional and may come from
+// several threads at once
+class SparseFile {
+public:
+  SparseFile() = default;
+  ~SparseFile();
+
+  SparseFile(const SparseFile &) = delete;
+  SparseFile &operator=(const SparseFile &) = delete;
+
+  // sparse reports whether the file system keeps the holes unallocated
+  bool create(const std::filesystem::path &path, uint64_t size, bool &sparse);
+  bool write(uint64_t offset, const char *data, uint64_t length);
+
+  // Space the file occupies on disk
+  static uint64_t getAllocatedSize(const std::filesystem::path &path);
+
+private:
+#ifdef _WIN32
+  void *m_handle{nullptr};
+#else
+  int m_descriptor{-1};
+#endif
+};
+
+struct SparseCopyReport {
+  bool success{false};
+  bool sparse{false};        ///< the output file system supports holes
+  uint64_t imageSize{0};     ///< logical size of the copy, same as the source
+  uint64_t copiedBytes{0};   ///< live sectors read and written
+  uint64_t allocatedSize{0}; ///< space the copy occupies on disk
+};
+
+// Copies an image keeping its layout, but writing only the sectors which are
+// in use; the video partition and padding are left as holes which read back
+// as zeros. The copy mounts exactly as the source does
+SparseCopyReport sparseCopy(const Container &container,
+                            const std::filesystem::path &output);
+} // namespace vfs
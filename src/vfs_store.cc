@@ -0,0 +1,401 @@
+// Part of xbox-iso-vfs
+
+#include "vfs_store.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace vfs {
+namespace {
+constexpr static uint32_t sc_importBufferSize = 1024 * 1024;
+constexpr static size_t sc_indexSuffixLength = 8;
+constexpr static int sc_stagingAttempts = 64;
+
+// Creates the file only if nothing exists at the path yet
+bool createExclusive(const std::filesystem::path &path) {
+#ifdef _WIN32
+  auto file = _wfopen(path.c_str(), L"wbx");
+#else
+  auto file = std::fopen(path.c_str(), "wbx");
+#endif
+  if (!file) {
+    return false;
+  }
+
+  std::fclose(file);
+  return true;
+}
+
+uint64_t getProcessId() {
+#ifdef _WIN32
+  return static_cast<uint64_t>(_getpid());
+#else
+  return static_cast<uint64_t>(getpid());
+#endif
+}
+
+bool hashFile(const std::filesystem::path &path, ContentHash &hash) {
+  std::ifstream file(path, std::ifstream::binary | std::ifstream::in);
+  if (!file.is_open()) {
+    return false;
+  }
+
+  Sha256 sha;
+  std::vector<char> buffer(sc_importBufferSize);
+
+  while (file) {
+    file.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    sha.update(buffer.data(), static_cast<size_t>(file.gcount()));
+  }
+
+  if (file.bad()) {
+    return false;
+  }
+
+  hash = sha.finish();
+  return true;
+}
+
+// Removes the staging copy however the import ends
+struct StagingFile {
+  std::filesystem::path path;
+
+  ~StagingFile() {
+    std::error_code errorCode;
+    std::filesystem::remove(path, errorCode);
+  }
+};
+
+// Hashes a file of the container, copying it to the staging path as well
+// when one is given
+bool hashEntry(Container &container, Container::EntryHandle handle,
+               std::vector<char> &buffer, ContentHash &hash,
+               const std::filesystem::path *stagingPath) {
+  std::ofstream staging;
+  if (stagingPath) {
+    staging.open(*stagingPath, std::ofstream::binary | std::ofstream::out |
+                                   std::ofstream::trunc);
+    if (!staging.is_open()) {
+      return false;
+    }
+  }
+
+  Sha256 sha;
+  auto size = container.getEntry(handle)->getFileSize();
+
+  for (uint32_t done = 0; done < size;) {
+    auto length = container.readEntry(
+        handle, buffer.data(), static_cast<uint32_t>(buffer.size()), done);
+    if (length == 0) {
+      return false;
+    }
+
+    sha.update(buffer.data(), length);
+    if (stagingPath) {
+      staging.write(buffer.data(), length);
+    }
+    done += length;
+  }
+
+  hash = sha.finish();
+
+  if (stagingPath) {
+    staging.close();
+    return !staging.fail();
+  }
+
+  return true;
+}
+} // namespace
+
+ContentStore::~ContentStore() {
+  MemoryGovernor::getDefault().removeConsumer(m_memoryId);
+}
+
+bool ContentStore::open(const std::filesystem::path &root) {
+  std::error_code errorCode;
+
+  std::filesystem::create_directories(root / "objects", errorCode);
+  std::filesystem::create_directories(root / "images", errorCode);
+
+  if (!std::filesystem::is_directory(root / "objects", errorCode) ||
+      !std::filesystem::is_directory(root / "images", errorCode)) {
+    return false;
+  }
+
+  m_root = root;
+
+  // Stores which fail to open never reach the governor, so they can be
+  // dropped under any lock
+  if (m_memoryId == 0) {
+    m_memoryId = MemoryGovernor::getDefault().addConsumer(
+        MemoryCategory::Cache,
+        [this](uint64_t bytes) { return trimCache(bytes); });
+  }
+
+  return true;
+}
+
+std::filesystem::path
+ContentStore::getObjectPath(const ContentHash &hash) const {
+  auto name = Sha256::toString(hash);
+  return m_root / "objects" / name.substr(0, 2) / name.substr(2);
+}
+
+std::filesystem::path
+ContentStore::getIndexPath(const std::wstring &name) const {
+  return m_root / "images" / fromWideString(name + L".xidx");
+}
+
+bool ContentStore::contains(const ContentHash &hash) const {
+  std::error_code errorCode;
+  return std::filesystem::exists(getObjectPath(hash), errorCode);
+}
+
+std::filesystem::path ContentStore::createStagingFile() const {
+  static std::atomic<uint64_t> counter{0};
+
+  auto directory = m_root / "objects" / "staging";
+  std::error_code errorCode;
+  std::filesystem::create_directories(directory, errorCode);
+
+  // The process id keeps concurrent imports apart and the counter the files
+  // of one; names left behind by an earlier process with the same id are
+  // skipped
+  for (int attempt = 0; attempt < sc_stagingAttempts; ++attempt) {
+    auto path = directory / (std::to_string(getProcessId()) + "." +
+                             std::to_string(counter++));
+    if (createExclusive(path)) {
+      return path;
+    }
+    if (!std::filesystem::exists(path, errorCode)) {
+      break;
+    }
+  }
+
+  return {};
+}
+
+std::filesystem::path ContentStore::saveIndex(const Container &container,
+                                              const std::wstring &name,
+                                              bool &renamed) const {
+  renamed = false;
+
+  auto indexPath = getIndexPath(name);
+  auto partialPath = indexPath;
+  partialPath += L".partial";
+
+  std::error_code errorCode;
+  ContentHash hash;
+
+  if (!container.saveIndex(partialPath) || !hashFile(partialPath, hash)) {
+    std::filesystem::remove(partialPath, errorCode);
+    return {};
+  }
+
+  if (std::filesystem::exists(indexPath, errorCode)) {
+    ContentHash existing;
+    if (!hashFile(indexPath, existing) || existing != hash) {
+      auto suffix = Sha256::toString(hash).substr(0, sc_indexSuffixLength);
+      indexPath =
+          getIndexPath(name + L"-" + std::wstring(suffix.begin(), suffix.end()));
+      renamed = true;
+    }
+  }
+
+  std::filesystem::rename(partialPath, indexPath, errorCode);
+  if (errorCode) {
+    std::filesystem::remove(partialPath, errorCode);
+    return {};
+  }
+
+  return indexPath;
+}
+
+uint32_t ContentStore::read(const ContentHash &hash, uint32_t objectSize,
+                            void *buffer, uint32_t bufferlength,
+                            int64_t offset) {
+  if (offset < 0 || static_cast<uint64_t>(offset) >= objectSize) {
+    return 0;
+  }
+
+  auto position = static_cast<uint32_t>(offset);
+  auto readLength = std::min(bufferlength, objectSize - position);
+
+  auto destination = static_cast<char *>(buffer);
+  uint32_t done = 0;
+
+  while (done < readLength) {
+    auto blockIndex = (position + done) / sc_blockSize;
+    auto blockOffset = (position + done) % sc_blockSize;
+
+    auto block = getBlock({hash, blockIndex}, objectSize);
+    if (!block || blockOffset >= block->size()) {
+      break;
+    }
+
+    auto length = std::min<uint32_t>(
+        readLength - done, static_cast<uint32_t>(block->size()) - blockOffset);
+    std::memcpy(destination + done, block->data() + blockOffset, length);
+
+    done += length;
+  }
+
+  return done;
+}
+
+ContentStore::Stats ContentStore::getStats() const {
+  std::lock_guard<std::mutex> lock(m_cacheMutex);
+
+  Stats stats;
+  stats.cacheBytes = m_cacheBytes;
+  stats.cacheBudget = m_cacheBudget;
+  stats.hits = m_hits;
+  stats.misses = m_misses;
+
+  return stats;
+}
+
+ContentStore::Block ContentStore::getBlock(const BlockKey &key,
+                                           uint32_t objectSize) {
+  {
+    std::lock_guard<std::mutex> lock(m_cacheMutex);
+
+    auto it = m_blocks.find(key);
+    if (it != m_blocks.end()) {
+      m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+      ++m_hits;
+      return it->second.block;
+    }
+
+    ++m_misses;
+  }
+
+  // Load outside the lock; a racing load of the same block is harmless
+  auto blockStart = static_cast<uint64_t>(key.index) * sc_blockSize;
+  auto blockLength = static_cast<size_t>(
+      std::min<uint64_t>(sc_blockSize, objectSize - blockStart));
+
+  auto data = std::make_shared<std::vector<char>>(blockLength);
+
+  std::ifstream file(getObjectPath(key.hash),
+                     std::ifstream::binary | std::ifstream::in);
+  if (!file.is_open()) {
+    return nullptr;
+  }
+
+  file.seekg(static_cast<std::streamoff>(blockStart), std::ifstream::beg);
+  file.read(data->data(), static_cast<std::streamsize>(blockLength));
+  if (static_cast<size_t>(file.gcount()) != blockLength) {
+    return nullptr;
+  }
+
+  std::lock_guard<std::mutex> lock(m_cacheMutex);
+
+  auto it = m_blocks.find(key);
+  if (it != m_blocks.end()) {
+    return it->second.block;
+  }
+
+  m_lru.push_front(key);
+  m_blocks.emplace(key, CacheItem{data, m_lru.begin()});
+  m_cacheBytes += blockLength;
+
+  MemoryGovernor::getDefault().charge(m_memoryId,
+                                      static_cast<int64_t>(blockLength));
+
+  if (m_cacheBytes > m_cacheBudget && m_lru.size() > 1) {
+    evictBlocks(m_cacheBytes - m_cacheBudget);
+  }
+
+  return data;
+}
+
+uint64_t ContentStore::evictBlocks(uint64_t bytes) {
+  uint64_t evicted = 0;
+
+  // Blocks still referenced by a reader stay alive until the read completes
+  while (evicted < bytes && !m_lru.empty()) {
+    auto victim = m_blocks.find(m_lru.back());
+    evicted += victim->second.block->size();
+    m_blocks.erase(victim);
+    m_lru.pop_back();
+  }
+
+  m_cacheBytes -= evicted;
+  MemoryGovernor::getDefault().charge(m_memoryId,
+                                      -static_cast<int64_t>(evicted));
+
+  return evicted;
+}
+
+uint64_t ContentStore::trimCache(uint64_t bytes) {
+  std::lock_guard<std::mutex> lock(m_cacheMutex);
+  return evictBlocks(bytes);
+}
+
+ImportReport importImage(ContentStore &store, Container &container) {
+  ImportReport report;
+
+  std::error_code errorCode;
+  std::vector<ContentHash> hashes(container.getEntryCount());
+  std::vector<char> buffer(sc_importBufferSize);
+
+  for (size_t handle = 0; handle < container.getEntryCount(); ++handle) {
+    auto entry = container.getEntry(handle);
+    if (entry->isDirectory()) {
+      continue;
+    }
+
+    // Hash first so content already in the store is never written. New
+    // content is read again into staging, and kept only if it still matches
+    if (!hashEntry(container, handle, buffer, hashes[handle], nullptr)) {
+      return report;
+    }
+    ++report.files;
+
+    if (store.contains(hashes[handle])) {
+      report.sharedBytes += entry->getFileSize();
+      continue;
+    }
+
+    StagingFile staging{store.createStagingFile()};
+    if (staging.path.empty()) {
+      return report;
+    }
+
+    ContentHash staged;
+    if (!hashEntry(container, handle, buffer, staged, &staging.path) ||
+        staged != hashes[handle]) {
+      return report;
+    }
+
+    auto objectPath = store.getObjectPath(hashes[handle]);
+    std::filesystem::create_directories(objectPath.parent_path(), errorCode);
+    std::filesystem::rename(staging.path, objectPath, errorCode);
+    if (errorCode) {
+      return report;
+    }
+
+    ++report.newObjects;
+    report.newBytes += entry->getFileSize();
+  }
+
+  container.setContentHashes(std::move(hashes));
+
+  report.indexPath =
+      store.saveIndex(container, container.getFilename(), report.renamed);
+  report.success = !report.indexPath.empty();
+
+  return report;
+}
+} // namespace vfs
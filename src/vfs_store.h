@@ -0,0 +1,128 @@
+// Part of xbox-iso-vfs
+
+#pragma once
+
+#include "vfs.h"
+#include "vfs_hash.h"
+#include "vfs_memory.h"
+
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace vfs {
+// Directory of file contents keyed by SHA-256, shared by any number of
+// indexed images. Reads go through one block cache so identical files mounted
+// from different images are only cached once. The cache is charged to the
+// memory governor, which may trim it below its own budget
+//
+//   <root>/objects/ab/cdef...  file contents
+//   <root>/images/<name>.xidx  container index referencing the objects
+class ContentStore {
+public:
+  constexpr static uint32_t sc_blockSize = 64 * 1024;
+  constexpr static uint64_t sc_defaultCacheBudget = 256 * 1024 * 1024;
+
+  struct Stats {
+    uint64_t cacheBytes{0};
+    uint64_t cacheBudget{0};
+    uint64_t hits{0};
+    uint64_t misses{0};
+  };
+
+  explicit ContentStore(uint64_t cacheBudget = sc_defaultCacheBudget)
+      : m_cacheBudget(cacheBudget) {}
+  ~ContentStore();
+
+  ContentStore(const ContentStore &) = delete;
+  ContentStore &operator=(const ContentStore &) = delete;
+
+  bool open(const std::filesystem::path &root);
+
+  const std::filesystem::path &getRoot() const { return m_root; }
+  std::filesystem::path getObjectPath(const ContentHash &hash) const;
+  std::filesystem::path getIndexPath(const std::wstring &name) const;
+
+  bool contains(const ContentHash &hash) const;
+
+  // Creates an empty file in <root>/objects/staging under a name no other
+  // import uses, in this process or another, for content to be written to
+  // before it is renamed into place. Returns an empty path on failure
+  std::filesystem::path createStagingFile() const;
+
+  // Saves the index as <name>.xidx. When a different image already uses the
+  // name, the index is saved as <name>-<hash>.xidx instead, with a suffix
+  // taken from its contents so the same image is always given the same name.
+  // Returns the path saved to, empty on failure
+  std::filesystem::path saveIndex(const Container &container,
+                                  const std::wstring &name,
+                                  bool &renamed) const;
+
+  // Same semantics as FileEntry::read, for the object of the given size
+  uint32_t read(const ContentHash &hash, uint32_t objectSize, void *buffer,
+                uint32_t bufferlength, int64_t offset);
+
+  Stats getStats() const;
+
+private:
+  struct BlockKey {
+    ContentHash hash;
+    uint32_t index;
+
+    bool operator==(const BlockKey &other) const {
+      return index == other.index && hash == other.hash;
+    }
+  };
+
+  struct BlockKeyHash {
+    size_t operator()(const BlockKey &key) const {
+      // The content hash is already uniformly distributed
+      size_t value;
+      std::copy(key.hash.begin(), key.hash.begin() + sizeof(value),
+                reinterpret_cast<uint8_t *>(&value));
+      return value ^ key.index;
+    }
+  };
+
+  using Block = std::shared_ptr<const std::vector<char>>;
+
+  struct CacheItem {
+    Block block;
+    std::list<BlockKey>::iterator lru;
+  };
+
+  Block getBlock(const BlockKey &key, uint32_t objectSize);
+
+  // Evicts least recently used blocks; the caller holds m_cacheMutex
+  uint64_t evictBlocks(uint64_t bytes);
+  uint64_t trimCache(uint64_t bytes);
+
+  std::filesystem::path m_root;
+
+  mutable std::mutex m_cacheMutex;
+  std::list<BlockKey> m_lru; // most recently used first
+  std::unordered_map<BlockKey, CacheItem, BlockKeyHash> m_blocks;
+  uint64_t m_cacheBytes{0};
+  uint64_t m_cacheBudget;
+  uint64_t m_hits{0};
+  uint64_t m_misses{0};
+
+  MemoryGovernor::ConsumerId m_memoryId{0}; ///< registered once opened
+};
+
+struct ImportReport {
+  bool success{false};
+  size_t files{0};
+  size_t newObjects{0};
+  uint64_t newBytes{0};     ///< bytes added to the store
+  uint64_t sharedBytes{0};  ///< bytes already present in the store
+  std::filesystem::path indexPath;
+  bool renamed{false}; ///< the image name was taken by a different image
+};
+
+// Copies every file of an image into the store and writes its index
+ImportReport importImage(ContentStore &store, Container &container);
+} // namespace vfs
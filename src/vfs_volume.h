@@ -0,0 +1,40 @@
+// Part of xbox-iso-vfs
+
+#pragma once
+
+#include "vfs.h"
+
+#include <atomic>
+#include <memory>
+
+namespace vfs {
+// What a mount point serves. The container behind it can be replaced while
+// mounted: each opened handle pins the container that was current when it
+// was opened, so reads on existing handles finish against the old image and
+// new opens see the new one. A replaced container is released when its last
+// handle closes
+class Volume {
+public:
+  explicit Volume(std::shared_ptr<Container> container)
+      : m_current(std::move(container)) {}
+
+  std::shared_ptr<Container> acquire() const {
+    return std::atomic_load_explicit(&m_current, std::memory_order_acquire);
+  }
+
+  // Publishes the new container and returns the previous one
+  std::shared_ptr<Container> replace(std::shared_ptr<Container> container) {
+    auto previous = std::atomic_exchange_explicit(
+        &m_current, std::move(container), std::memory_order_acq_rel);
+    ++m_generation;
+    return previous;
+  }
+
+  // Number of times the container was replaced
+  uint64_t getGeneration() const { return m_generation; }
+
+private:
+  std::shared_ptr<Container> m_current;
+  std::atomic<uint64_t> m_generation{0};
+};
+} // namespace vfs
@@ -2,54 +2,325 @@
 
 #include "xdvdfs.h"
 
+#include <algorithm>
+#include <array>
 #include <cstring>
+#include <future>
 #include <iostream>
+#include <string>
+#include <system_error>
 #include <vector>
 
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
+
 namespace xdvdfs {
-void VolumeDescriptor::readFromFile(Stream &file) {
-  std::vector<char> buffer(SECTOR_SIZE);
+namespace {
+// Identifies the volume a file is on; parts on different volumes can be read
+// at the same time
+uint64_t getDevice(const std::filesystem::path &path) {
+#ifdef _WIN32
+  wchar_t volume[MAX_PATH + 1];
+  if (!GetVolumePathNameW(path.c_str(), volume, MAX_PATH + 1)) {
+    return 0;
+  }
 
-  {
-    std::lock_guard<std::mutex> lock(file.m_fileMutex);
+  return std::hash<std::wstring>()(volume);
+#else
+  struct stat status;
+  if (stat(path.c_str(), &status) != 0) {
+    return 0;
+  }
+
+  return static_cast<uint64_t>(status.st_dev);
+#endif
+}
 
-    file.m_file.seekg(VOLUME_DESCRIPTOR_SECTOR * SECTOR_SIZE + file.m_offset,
-                      std::ifstream::beg);
-    file.m_file.read(buffer.data(), buffer.size());
+// Number of a split part from its name (name.N.iso), or 0
+unsigned getPartNumber(const std::filesystem::path &path) {
+  auto number = path.stem().extension().string();
+  if (number.size() < 2 || number.size() > 4 ||
+      !std::all_of(number.begin() + 1, number.end(),
+                   [](char c) { return c >= '0' && c <= '9'; })) {
+    return 0;
   }
 
-  std::copy(buffer.begin(), buffer.begin() + 0x14, m_id1);
-  std::copy(buffer.begin() + 0x14, buffer.begin() + 0x18,
-            reinterpret_cast<char *>(&m_rootDirTableSector));
-  std::copy(buffer.begin() + 0x18, buffer.begin() + 0x1C,
-            reinterpret_cast<char *>(&m_rootDirTableSize));
-  std::copy(buffer.begin() + 0x1C, buffer.begin() + 0x24,
-            reinterpret_cast<char *>(&m_filetime));
-  std::copy(buffer.begin() + 0x7EC, buffer.end(), m_id2);
+  return static_cast<unsigned>(std::stoul(number.substr(1)));
 }
+} // namespace
+
+bool Stream::open(const std::vector<std::filesystem::path> &paths,
+                  bool directIO) {
+  m_parts.clear();
+  m_directUnsupported = false;
+
+  uint64_t offset = 0;
+  for (const auto &path : paths) {
+    auto part = std::make_unique<StreamPart>();
+    part->path = path;
+
+    std::error_code errorCode;
+    part->size = std::filesystem::file_size(path, errorCode);
+    if (errorCode) {
+      return false;
+    }
 
-bool VolumeDescriptor::validate() const {
-  if (std::memcmp(m_id1, MAGIC_ID, std::size(m_id1)) != 0) {
+    if (directIO) {
+      part->direct =
+          std::make_unique<DirectReader>(AlignedBufferPool::getDefault());
+      if (!part->direct->open(path)) {
+        // The volume may not allow unbuffered reads (tmpfs rejects O_DIRECT),
+        // so the whole image is read through the file cache instead
+        if (!open(paths, false)) {
+          return false;
+        }
+
+        m_directUnsupported = true;
+        return true;
+      }
+    } else {
+      part->file.open(path, std::ifstream::binary | std::ifstream::in);
+      if (!part->file.is_open()) {
+        return false;
+      }
+    }
+
+    part->offset = offset;
+    part->device = getDevice(path);
+    offset += part->size;
+
+    m_parts.emplace_back(std::move(part));
+  }
+
+  return !m_parts.empty();
+}
+
+std::vector<std::filesystem::path>
+Stream::findParts(const std::filesystem::path &path) {
+  if (getPartNumber(path) == 0) {
+    return {path};
+  }
+
+  auto base = path.parent_path() / path.stem().stem();
+
+  std::vector<std::filesystem::path> parts;
+  for (unsigned number = 1;; ++number) {
+    auto part = base;
+    part += "." + std::to_string(number);
+    part += path.extension();
+
+    std::error_code errorCode;
+    if (!std::filesystem::is_regular_file(part, errorCode)) {
+      break;
+    }
+
+    parts.emplace_back(std::move(part));
+  }
+
+  // A lone name.1.iso is a whole image
+  if (parts.size() < 2 ||
+      std::find(parts.begin(), parts.end(), path) == parts.end()) {
+    return {path};
+  }
+
+  return parts;
+}
+
+bool Stream::isContinuationPart(const std::filesystem::path &path) {
+  return getPartNumber(path) > 1 && findParts(path).size() > 1;
+}
+
+uint64_t Stream::getSize() const {
+  if (m_parts.empty()) {
+    return 0;
+  }
+
+  return m_parts.back()->offset + m_parts.back()->size;
+}
+
+std::vector<std::filesystem::path> Stream::getPartPaths() const {
+  std::vector<std::filesystem::path> paths;
+  for (const auto &part : m_parts) {
+    paths.emplace_back(part->path);
+  }
+
+  return paths;
+}
+
+uint64_t Stream::readPart(StreamPart &part, char *buffer, uint64_t length,
+                          uint64_t position) {
+  if (part.direct) {
+    return part.direct->read(buffer, length, position);
+  }
+
+  std::lock_guard<std::mutex> lock(part.fileMutex);
+
+  part.file.clear();
+  part.file.seekg(static_cast<std::streamoff>(position), std::ifstream::beg);
+  part.file.read(buffer, static_cast<std::streamsize>(length));
+
+  return static_cast<uint64_t>(part.file.gcount());
+}
+
+uint64_t Stream::readAt(void *buffer, uint64_t length, uint64_t position) {
+  if (m_parts.empty()) {
+    return length <= UINT32_MAX &&
+                   readResident(buffer, position,
+                                static_cast<uint32_t>(length))
+               ? length
+               : 0;
+  }
+
+  // Last part starting at or before the position
+  auto it = std::upper_bound(
+      m_parts.begin(), m_parts.end(), position,
+      [](uint64_t value, const std::unique_ptr<StreamPart> &part) {
+        return value < part->offset;
+      });
+  if (it == m_parts.begin()) {
+    return 0;
+  }
+  --it;
+
+  auto destination = static_cast<char *>(buffer);
+
+  // Almost every read is within one part
+  auto &part = **it;
+  auto partPosition = position - part.offset;
+  if (std::next(it) == m_parts.end() ||
+      partPosition + length <= part.size) {
+    return readPart(part, destination, length, partPosition);
+  }
+
+  struct Segment {
+    StreamPart *part;
+    char *destination;
+    uint64_t length;
+    uint64_t position;
+    uint64_t bytesRead;
+  };
+
+  std::vector<Segment> segments;
+  for (uint64_t done = 0; done < length && it != m_parts.end(); ++it) {
+    auto &current = **it;
+    auto start = (position + done) - current.offset;
+    if (start >= current.size && std::next(it) != m_parts.end()) {
+      continue;
+    }
+
+    auto segmentLength = std::next(it) == m_parts.end()
+                             ? length - done
+                             : std::min(length - done, current.size - start);
+
+    segments.push_back(
+        {&current, destination + done, segmentLength, start, 0});
+    done += segmentLength;
+  }
+
+  auto readSegments = [&segments](uint64_t device) {
+    for (auto &segment : segments) {
+      if (segment.part->device == device) {
+        segment.bytesRead = readPart(*segment.part, segment.destination,
+                                     segment.length, segment.position);
+      }
+    }
+  };
+
+  // Each further volume is read on its own thread
+  std::vector<uint64_t> devices;
+  std::vector<std::future<void>> pending;
+  for (const auto &segment : segments) {
+    auto device = segment.part->device;
+    if (std::find(devices.begin(), devices.end(), device) != devices.end()) {
+      continue;
+    }
+
+    if (!devices.empty()) {
+      pending.emplace_back(
+          std::async(std::launch::async, readSegments, device));
+    }
+    devices.emplace_back(device);
+  }
+
+  readSegments(devices.front());
+  for (auto &future : pending) {
+    future.wait();
+  }
+
+  // Only the bytes up to the first short read are contiguous
+  uint64_t total = 0;
+  for (const auto &segment : segments) {
+    total += segment.bytesRead;
+    if (segment.bytesRead < segment.length) {
+      break;
+    }
+  }
+
+  return total;
+}
+
+bool Stream::readResident(void *buffer, uint64_t offset,
+                          uint32_t length) const {
+  if (m_residentExtents.empty()) {
     return false;
   }
 
-  if (m_rootDirTableSector == 0 || m_rootDirTableSize == 0) {
+  // Last extent starting at or before the offset
+  auto it = std::upper_bound(
+      m_residentExtents.begin(), m_residentExtents.end(), offset,
+      [](uint64_t value, const ResidentExtent &extent) {
+        return value < extent.offset;
+      });
+  if (it == m_residentExtents.begin()) {
     return false;
   }
+  --it;
 
-  if (std::memcmp(m_id1, MAGIC_ID, std::size(m_id2)) != 0) {
+  if (offset + length > it->offset + it->size) {
     return false;
   }
 
+  std::memcpy(buffer, it->data + (offset - it->offset), length);
   return true;
 }
+} // namespace xdvdfs
+
+namespace xdvdfs {
+void VolumeDescriptor::readFromFile(Stream &file) {
+  std::array<uint8_t, SECTOR_SIZE> sector{};
 
-FileEntry VolumeDescriptor::getRootDirEntry(Stream &file) const {
-  FileEntry dirent;
+  file.readAt(sector.data(), sector.size(),
+              VOLUME_DESCRIPTOR_SECTOR * SECTOR_SIZE + file.m_offset);
 
-  dirent.readFromFile(file, m_rootDirTableSector, 0);
+  parse(sector.data());
+}
 
-  return dirent;
+void VolumeDescriptor::parse(const uint8_t *sector) {
+  std::memcpy(m_id1, sector + ID1_OFFSET, sizeof(m_id1));
+  m_rootDirTableSector = loadLittleEndian32(sector + ROOT_SECTOR_OFFSET);
+  m_rootDirTableSize = loadLittleEndian32(sector + ROOT_SIZE_OFFSET);
+  m_filetime = loadLittleEndian64(sector + FILETIME_OFFSET);
+  std::memcpy(m_id2, sector + ID2_OFFSET, sizeof(m_id2));
+}
+
+bool VolumeDescriptor::validate() const {
+  if (std::memcmp(m_id1, MAGIC_ID, std::size(m_id1)) != 0) {
+    return false;
+  }
+
+  if (m_rootDirTableSector == 0 || m_rootDirTableSize == 0) {
+    return false;
+  }
+
+  if (std::memcmp(m_id2, MAGIC_ID, std::size(m_id2)) != 0) {
+    return false;
+  }
+
+  return true;
 }
 } // namespace xdvdfs
 
@@ -59,41 +330,49 @@ FileEntry::FileEntry(const FileEntry &other)
     : m_leftSubTree(other.m_leftSubTree), m_rightSubTree(other.m_rightSubTree),
       m_startSector(other.m_startSector), m_fileSize(other.m_fileSize),
       m_attributes(other.m_attributes), m_filename(other.m_filename),
-      m_sectorNumber(other.m_sectorNumber) {}
+      m_sectorNumber(other.m_sectorNumber),
+      m_tableOffset(other.m_tableOffset) {}
 
 FileEntry::FileEntry(const std::string &name)
     : m_attributes(FileEntry::FILE_DIRECTORY), m_filename(name) {}
 
-void FileEntry::readFromFile(Stream &file, std::streampos sector,
-                             std::streamoff offset) {
-  std::vector<char> buffer(SECTOR_SIZE);
+FileEntry::FileEntry(const std::string &name, uint32_t startSector,
+                     uint32_t fileSize, uint8_t attributes,
+                     uint32_t tableSector, uint32_t tableOffset)
+    : m_leftSubTree(0), m_rightSubTree(0), m_startSector(startSector),
+      m_fileSize(fileSize), m_attributes(attributes), m_filename(name),
+      m_sectorNumber(tableSector), m_tableOffset(tableOffset) {}
 
-  {
-    std::lock_guard<std::mutex> lock(file.m_fileMutex);
+bool FileEntry::parse(const uint8_t *table, size_t tableSize, size_t offset,
+                      uint32_t tableSector) {
+  m_sectorNumber = tableSector;
+  m_tableOffset = static_cast<std::streamoff>(offset);
 
-    file.m_file.seekg((sector * SECTOR_SIZE) + file.m_offset + offset,
-                      std::ifstream::beg);
-    file.m_file.read(buffer.data(), buffer.size());
+  if (offset + NAME_OFFSET > tableSize) {
+    m_leftSubTree = static_cast<uint16_t>(-1);
+    return false;
   }
 
-  m_sectorNumber = sector;
+  auto entry = table + offset;
+  m_leftSubTree = loadLittleEndian16(entry + LEFT_OFFSET);
+  m_rightSubTree = loadLittleEndian16(entry + RIGHT_OFFSET);
+  m_startSector = loadLittleEndian32(entry + START_SECTOR_OFFSET);
+  m_fileSize = loadLittleEndian32(entry + FILE_SIZE_OFFSET);
+  m_attributes = entry[ATTRIBUTES_OFFSET];
 
-  std::copy(buffer.begin(), buffer.begin() + 0x02,
-            reinterpret_cast<char *>(&m_leftSubTree));
-  std::copy(buffer.begin() + 0x02, buffer.begin() + 0x04,
-            reinterpret_cast<char *>(&m_rightSubTree));
-  std::copy(buffer.begin() + 0x04, buffer.begin() + 0x08,
-            reinterpret_cast<char *>(&m_startSector));
-  std::copy(buffer.begin() + 0x08, buffer.begin() + 0x0C,
-            reinterpret_cast<char *>(&m_fileSize));
-  std::copy(buffer.begin() + 0x0C, buffer.begin() + 0x0D,
-            reinterpret_cast<char *>(&m_attributes));
-
-  if (validate()) {
-    size_t filenameLength{static_cast<uint8_t>(buffer[0x0D])};
+  if (!validate()) {
+    return false;
+  }
 
-    m_filename = std::string(&buffer[0x0E], filenameLength);
+  size_t filenameLength = entry[NAME_LENGTH_OFFSET];
+  if (offset + NAME_OFFSET + filenameLength > tableSize) {
+    m_leftSubTree = static_cast<uint16_t>(-1);
+    return false;
   }
+
+  m_filename.assign(reinterpret_cast<const char *>(entry + NAME_OFFSET),
+                    filenameLength);
+  return true;
 }
 
 const std::string &FileEntry::getFilename() const { return m_filename; }
@@ -102,32 +381,24 @@ uint32_t FileEntry::getFileSize() const { return m_fileSize; }
 
 uint32_t FileEntry::read(Stream &file, void *buffer, uint32_t bufferlength,
                          int64_t offset) const {
-  if (offset < 0) {
+  // Compared at full width; an offset past 4 GiB must not wrap into the file
+  if (offset < 0 || bufferlength == 0 ||
+      static_cast<uint64_t>(offset) >= getFileSize()) {
     return 0;
   }
 
   auto localOffset = static_cast<uint32_t>(offset);
-  if (bufferlength && localOffset < getFileSize()) {
-    auto readLength = bufferlength;
-
-    if (localOffset + bufferlength >= getFileSize()) {
-      readLength = getFileSize() - localOffset;
-    }
-
-    auto baseOffset = SECTOR_SIZE * static_cast<int64_t>(m_startSector) +
-                      file.m_offset + localOffset;
+  auto readLength = std::min(bufferlength, getFileSize() - localOffset);
 
-    {
-      std::lock_guard<std::mutex> lock(file.m_fileMutex);
-
-      file.m_file.seekg(baseOffset, std::ifstream::beg);
-      file.m_file.read(static_cast<char *>(buffer), readLength);
-
-      return readLength;
-    }
+  auto partitionOffset =
+      SECTOR_SIZE * static_cast<uint64_t>(m_startSector) + localOffset;
+  if (file.readResident(buffer, partitionOffset, readLength)) {
+    return readLength;
   }
 
-  return 0;
+  auto baseOffset = static_cast<uint64_t>(file.m_offset) + partitionOffset;
+
+  return static_cast<uint32_t>(file.readAt(buffer, readLength, baseOffset));
 }
 
 bool FileEntry::validate() const {
@@ -153,29 +424,4 @@ bool FileEntry::isDirectory() const {
 bool FileEntry::hasLeftChild() const { return (m_leftSubTree != 0); }
 
 bool FileEntry::hasRightChild() const { return (m_rightSubTree != 0); }
-
-FileEntry FileEntry::getLeftChild(Stream &file) {
-  FileEntry dirent;
-  dirent.readFromFile(file, m_sectorNumber,
-                      static_cast<std::streampos>(m_leftSubTree) * 4);
-
-  return dirent;
-}
-
-FileEntry FileEntry::getRightChild(Stream &file) {
-  FileEntry dirent;
-  dirent.readFromFile(file, m_sectorNumber,
-                      static_cast<std::streampos>(m_rightSubTree) * 4);
-
-  return dirent;
-}
-
-FileEntry FileEntry::getFirstEntry(Stream &file) {
-  FileEntry dirent;
-  if (isDirectory()) {
-    dirent.readFromFile(file, m_startSector, 0);
-  }
-
-  return dirent;
-}
 } // namespace xdvdfs
@@ -2,32 +2,141 @@
 
 #pragma once
 
+#include "xdvdfs_direct.h"
+
+#include <cstdint>
+#include <filesystem>
 #include <fstream>
 #include <limits>
+#include <memory>
 #include <mutex>
+#include <vector>
 
 namespace xdvdfs {
+// Part of the image which has been loaded into memory. Offsets are relative to
+// the start of the game partition
+struct ResidentExtent {
+  uint64_t offset;
+  uint64_t size;
+  const char *data;
+};
+
+// One file of an image. Split images are made of several, each holding the
+// next range of the logical image
+struct StreamPart {
+  std::filesystem::path path;
+  uint64_t offset{0}; ///< logical offset of the first byte of the part
+  uint64_t size{0};
+  uint64_t device{0}; ///< physical volume holding the part
+
+  std::ifstream file;
+  std::mutex fileMutex;
+  std::unique_ptr<DirectReader> direct;
+};
+
 class Stream {
 public:
   Stream() = default;
 
-  std::ifstream m_file;
+  // Opens the parts in order as one logical image. When direct I/O is asked
+  // for but a part cannot be opened for it, every part is opened buffered
+  // and isDirectUnsupported reports it
+  bool open(const std::vector<std::filesystem::path> &paths, bool directIO);
+
+  // The parts of a split image (name.1.iso, name.2.iso, ...) when given any
+  // one of them, otherwise just the path itself
+  static std::vector<std::filesystem::path>
+  findParts(const std::filesystem::path &path);
+
+  // True for the second and later parts of a split image, which are not
+  // images on their own
+  static bool isContinuationPart(const std::filesystem::path &path);
+
+  // Positional read from the logical image, through the direct readers when
+  // open. Ranges spanning parts on different volumes are read in parallel.
+  // A stream without parts serves only its resident extents. Returns the
+  // number of bytes read
+  uint64_t readAt(void *buffer, uint64_t length, uint64_t position);
+
+  bool isDirect() const { return !m_parts.empty() && m_parts[0]->direct; }
+  bool isDirectUnsupported() const { return m_directUnsupported; }
+  uint64_t getSize() const;
+  std::vector<std::filesystem::path> getPartPaths() const;
+
+  // Copies the range out of memory if it is fully resident. Extents are only
+  // changed before the stream is shared, so no locking is needed
+  bool readResident(void *buffer, uint64_t offset, uint32_t length) const;
+
   std::streampos m_offset;
 
-  std::mutex m_fileMutex;
+  std::vector<std::unique_ptr<StreamPart>> m_parts; // sorted by offset
+
+  std::vector<ResidentExtent> m_residentExtents; // sorted by offset
+  std::shared_ptr<char> m_residentMemory;
+
+private:
+  bool m_directUnsupported{false};
+
+  static uint64_t readPart(StreamPart &part, char *buffer, uint64_t length,
+                           uint64_t position);
 };
 
 constexpr static const int SECTOR_SIZE = 2048;
 constexpr static const int VOLUME_DESCRIPTOR_SECTOR = 32;
+
+// Some "dual layer" ISO files have both a video and game partition
+constexpr static const uint64_t GAME_PARTITION_OFFSET =
+    static_cast<uint64_t>(SECTOR_SIZE) * 32 * 6192;
+
 constexpr static const uint8_t MAGIC_ID[] = "MICROSOFT*XBOX*MEDIA";
 
+// On-disc fields are little-endian; these are correct on any host and any
+// alignment
+inline uint16_t loadLittleEndian16(const uint8_t *data) {
+  return static_cast<uint16_t>(data[0] | (data[1] << 8));
+}
+
+inline uint32_t loadLittleEndian32(const uint8_t *data) {
+  return static_cast<uint32_t>(data[0]) |
+         (static_cast<uint32_t>(data[1]) << 8) |
+         (static_cast<uint32_t>(data[2]) << 16) |
+         (static_cast<uint32_t>(data[3]) << 24);
+}
+
+inline uint64_t loadLittleEndian64(const uint8_t *data) {
+  return static_cast<uint64_t>(loadLittleEndian32(data)) |
+         (static_cast<uint64_t>(loadLittleEndian32(data + 4)) << 32);
+}
+
+inline void storeLittleEndian16(uint8_t *data, uint16_t value) {
+  data[0] = static_cast<uint8_t>(value & 0xFF);
+  data[1] = static_cast<uint8_t>(value >> 8);
+}
+
+inline void storeLittleEndian32(uint8_t *data, uint32_t value) {
+  for (int i = 0; i < 4; ++i) {
+    data[i] = static_cast<uint8_t>((value >> (i * 8)) & 0xFF);
+  }
+}
+
+inline void storeLittleEndian64(uint8_t *data, uint64_t value) {
+  storeLittleEndian32(data, static_cast<uint32_t>(value));
+  storeLittleEndian32(data + 4, static_cast<uint32_t>(value >> 32));
+}
+
 class FileEntry {
 public:
   FileEntry() = default;
   FileEntry(const FileEntry &other);
   FileEntry(const std::string &name);
+  FileEntry(const std::string &name, uint32_t startSector, uint32_t fileSize,
+            uint8_t attributes, uint32_t tableSector, uint32_t tableOffset);
 
-  void readFromFile(Stream &file, std::streampos sector, std::streamoff offset);
+  // Parses the entry at offset within a directory table held in memory,
+  // without allocating beyond the name. Fails if the entry or its name runs
+  // past the end of the table
+  bool parse(const uint8_t *table, size_t tableSize, size_t offset,
+             uint32_t tableSector);
 
   // matching dokany api for now
   uint32_t read(Stream &file, void *buffer, uint32_t bufferlength,
@@ -37,15 +146,24 @@ public:
 
   const std::string &getFilename() const;
   uint32_t getFileSize() const;
+  uint32_t getStartSector() const { return m_startSector; }
+
+  // Location of this entry within its parent directory table
+  uint32_t getTableSector() const {
+    return static_cast<uint32_t>(m_sectorNumber);
+  }
+  uint32_t getTableOffset() const {
+    return static_cast<uint32_t>(m_tableOffset);
+  }
 
   uint8_t getAttributes() const { return m_attributes; }
   bool isDirectory() const;
   bool hasLeftChild() const;
   bool hasRightChild() const;
 
-  FileEntry getLeftChild(Stream &file);
-  FileEntry getRightChild(Stream &file);
-  FileEntry getFirstEntry(Stream &file);
+  // Table offsets of the subtrees, in bytes
+  size_t getLeftOffset() const { return size_t(m_leftSubTree) * 4; }
+  size_t getRightOffset() const { return size_t(m_rightSubTree) * 4; }
 
   static const uint8_t FILE_READONLY = 0x01;
   static const uint8_t FILE_HIDDEN = 0x02;
@@ -54,6 +172,15 @@ public:
   static const uint8_t FILE_ARCHIVE = 0x20;
   static const uint8_t FILE_NORMAL = 0x80;
 
+  // Field offsets within an entry
+  static const size_t LEFT_OFFSET = 0x00;
+  static const size_t RIGHT_OFFSET = 0x02;
+  static const size_t START_SECTOR_OFFSET = 0x04;
+  static const size_t FILE_SIZE_OFFSET = 0x08;
+  static const size_t ATTRIBUTES_OFFSET = 0x0C;
+  static const size_t NAME_LENGTH_OFFSET = 0x0D;
+  static const size_t NAME_OFFSET = 0x0E;
+
 private:
   uint16_t m_leftSubTree{static_cast<uint16_t>(-1)};
   uint16_t m_rightSubTree{static_cast<uint16_t>(-1)};
@@ -63,16 +190,28 @@ private:
   std::string m_filename;
 
   std::streampos m_sectorNumber;
+  std::streamoff m_tableOffset{0};
 };
 
 class VolumeDescriptor {
 public:
   void readFromFile(Stream &file);
 
+  // Parses a whole descriptor sector held in memory
+  void parse(const uint8_t *sector);
+
   bool validate() const;
 
-  FileEntry getRootDirEntry(Stream &file) const;
   uint64_t getCreationTime() const { return m_filetime; }
+  uint32_t getRootDirTableSector() const { return m_rootDirTableSector; }
+  uint32_t getRootDirTableSize() const { return m_rootDirTableSize; }
+
+  // Field offsets within the descriptor sector
+  static const size_t ID1_OFFSET = 0x00;
+  static const size_t ROOT_SECTOR_OFFSET = 0x14;
+  static const size_t ROOT_SIZE_OFFSET = 0x18;
+  static const size_t FILETIME_OFFSET = 0x1C;
+  static const size_t ID2_OFFSET = 0x7EC;
 
 protected:
   uint8_t m_id1[0x14];           ///< 20 byte block containing the magic
@@ -0,0 +1,212 @@
+// Part of xbox-iso-vfs
+
+#include "xdvdfs_direct.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace xdvdfs {
+AlignedBufferPool::AlignedBufferPool(size_t bufferSize, size_t bufferCount)
+    : m_bufferSize((bufferSize + sc_alignment - 1) / sc_alignment *
+                   sc_alignment) {
+  m_memorySize = m_bufferSize * bufferCount;
+  m_memory = static_cast<char *>(
+      ::operator new(m_memorySize, std::align_val_t(sc_alignment)));
+
+  for (size_t i = 0; i < bufferCount; ++i) {
+    m_free.emplace_back(m_memory + i * m_bufferSize);
+  }
+
+  m_stats.allocatedBytes = m_memorySize;
+}
+
+AlignedBufferPool::~AlignedBufferPool() {
+  ::operator delete(m_memory, std::align_val_t(sc_alignment));
+}
+
+AlignedBufferPool &AlignedBufferPool::getDefault() {
+  static AlignedBufferPool pool(sc_defaultBufferSize, sc_defaultBufferCount);
+  return pool;
+}
+
+char *AlignedBufferPool::acquire() {
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  ++m_stats.acquisitions;
+  if (m_free.empty()) {
+    ++m_stats.waits;
+    m_available.wait(lock, [this]() { return !m_free.empty(); });
+  }
+
+  auto buffer = m_free.back();
+  m_free.pop_back();
+
+  m_stats.inUseBytes += m_bufferSize;
+  m_stats.peakInUseBytes =
+      std::max(m_stats.peakInUseBytes, m_stats.inUseBytes);
+
+  return buffer;
+}
+
+void AlignedBufferPool::release(char *buffer) {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_free.emplace_back(buffer);
+    m_stats.inUseBytes -= m_bufferSize;
+  }
+
+  m_available.notify_one();
+}
+
+AlignedBufferPool::Stats AlignedBufferPool::getStats() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_stats;
+}
+
+#ifdef _WIN32
+namespace {
+// Completion event for the reads of one thread
+struct ReadEvent {
+  HANDLE handle{CreateEventW(nullptr, TRUE, FALSE, nullptr)};
+
+  ~ReadEvent() {
+    if (handle) {
+      CloseHandle(handle);
+    }
+  }
+};
+} // namespace
+
+DirectReader::~DirectReader() {
+  if (m_handle) {
+    CloseHandle(m_handle);
+  }
+}
+
+bool DirectReader::open(const std::filesystem::path &path) {
+  auto handle = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                            nullptr, OPEN_EXISTING,
+                            FILE_FLAG_NO_BUFFERING | FILE_FLAG_RANDOM_ACCESS |
+                                FILE_FLAG_OVERLAPPED,
+                            nullptr);
+  if (handle == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+
+  m_handle = handle;
+  return true;
+}
+
+uint64_t DirectReader::readAligned(char *buffer, uint64_t length,
+                                   uint64_t position) {
+  // A synchronous handle would serialize the reads of every thread, so each
+  // one waits on its own event for the completion of its positional read
+  thread_local ReadEvent event;
+  if (!event.handle) {
+    return 0;
+  }
+
+  OVERLAPPED overlapped{};
+  overlapped.Offset = static_cast<DWORD>(position);
+  overlapped.OffsetHigh = static_cast<DWORD>(position >> 32);
+  overlapped.hEvent = event.handle;
+
+  DWORD bytesRead = 0;
+  if (!ReadFile(m_handle, buffer, static_cast<DWORD>(length), nullptr,
+                &overlapped) &&
+      GetLastError() != ERROR_IO_PENDING) {
+    return 0;
+  }
+
+  if (!GetOverlappedResult(m_handle, &overlapped, &bytesRead, TRUE)) {
+    return 0;
+  }
+
+  return bytesRead;
+}
+#else
+DirectReader::~DirectReader() {
+  if (m_descriptor >= 0) {
+    close(m_descriptor);
+  }
+}
+
+bool DirectReader::open(const std::filesystem::path &path) {
+  auto descriptor = ::open(path.c_str(), O_RDONLY | O_DIRECT);
+  if (descriptor < 0) {
+    return false;
+  }
+
+  m_descriptor = descriptor;
+  return true;
+}
+
+uint64_t DirectReader::readAligned(char *buffer, uint64_t length,
+                                   uint64_t position) {
+  uint64_t done = 0;
+
+  while (done < length) {
+    auto result = pread(m_descriptor, buffer + done, length - done,
+                        static_cast<off_t>(position + done));
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      break;
+    }
+
+    done += static_cast<uint64_t>(result);
+  }
+
+  return done;
+}
+#endif
+
+uint64_t DirectReader::read(void *buffer, uint64_t length, uint64_t position) {
+  constexpr static uint64_t sc_alignMask = AlignedBufferPool::sc_alignment - 1;
+
+  auto destination = static_cast<char *>(buffer);
+  auto staging = m_pool.acquire();
+  auto stagingSize = m_pool.getBufferSize();
+
+  uint64_t done = 0;
+  while (done < length) {
+    auto wanted = position + done;
+    auto alignedStart = wanted & ~sc_alignMask;
+    auto alignedEnd = (position + length + sc_alignMask) & ~sc_alignMask;
+    auto alignedLength = std::min<uint64_t>(alignedEnd - alignedStart,
+                                            stagingSize);
+
+    auto bytesRead = readAligned(staging, alignedLength, alignedStart);
+
+    auto skip = wanted - alignedStart;
+    if (bytesRead <= skip) {
+      break;
+    }
+
+    auto useful = std::min(bytesRead - skip, length - done);
+    std::memcpy(destination + done, staging + skip, useful);
+    done += useful;
+
+    // Short read means the end of the file
+    if (bytesRead < alignedLength) {
+      break;
+    }
+  }
+
+  m_pool.release(staging);
+
+  return done;
+}
+} // namespace xdvdfs
@@ -0,0 +1,83 @@
+// Part of xbox-iso-vfs
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <vector>
+
+namespace xdvdfs {
+// Fixed set of sector aligned buffers for unbuffered reads. The pool never
+// grows, so its footprint is the whole of the memory used by direct I/O
+class AlignedBufferPool {
+public:
+  constexpr static size_t sc_alignment = 4096;
+  constexpr static size_t sc_defaultBufferSize = 1024 * 1024;
+  constexpr static size_t sc_defaultBufferCount = 16;
+
+  struct Stats {
+    uint64_t allocatedBytes{0};
+    uint64_t inUseBytes{0};
+    uint64_t peakInUseBytes{0};
+    uint64_t acquisitions{0};
+    uint64_t waits{0}; ///< acquisitions which had to wait for a free buffer
+  };
+
+  AlignedBufferPool(size_t bufferSize, size_t bufferCount);
+  ~AlignedBufferPool();
+
+  AlignedBufferPool(const AlignedBufferPool &) = delete;
+  AlignedBufferPool &operator=(const AlignedBufferPool &) = delete;
+
+  // Shared by every stream opened for direct I/O in this process
+  static AlignedBufferPool &getDefault();
+
+  // Blocks until a buffer is free
+  char *acquire();
+  void release(char *buffer);
+
+  size_t getBufferSize() const { return m_bufferSize; }
+  Stats getStats() const;
+
+private:
+  size_t m_bufferSize;
+  char *m_memory{nullptr};
+  size_t m_memorySize{0};
+
+  mutable std::mutex m_mutex;
+  std::condition_variable m_available;
+  std::vector<char *> m_free;
+  Stats m_stats;
+};
+
+// Image file opened with the OS cache bypassed (FILE_FLAG_NO_BUFFERING or
+// O_DIRECT). Reads are positional (overlapped on Windows, so the I/O manager
+// does not serialize them), need no lock, and are widened to aligned ranges
+// which are staged through the buffer pool
+class DirectReader {
+public:
+  explicit DirectReader(AlignedBufferPool &pool) : m_pool(pool) {}
+  ~DirectReader();
+
+  DirectReader(const DirectReader &) = delete;
+  DirectReader &operator=(const DirectReader &) = delete;
+
+  bool open(const std::filesystem::path &path);
+
+  uint64_t read(void *buffer, uint64_t length, uint64_t position);
+
+private:
+  // Aligned position, length and buffer; returns bytes read
+  uint64_t readAligned(char *buffer, uint64_t length, uint64_t position);
+
+  AlignedBufferPool &m_pool;
+
+#ifdef _WIN32
+  void *m_handle{nullptr};
+#else
+  int m_descriptor{-1};
+#endif
+};
+} // namespace xdvdfs
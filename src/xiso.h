@@ -0,0 +1,146 @@
+/* Part of xbox-iso-vfs */
+
+/*
+ * C interface for reading Xbox ISO images in process, for emulators and other
+ * tools which link the reader directly rather than mounting the image.
+ *
+ * An image opened with xiso_open may be used from any number of threads at
+ * once; every function except xiso_close only reads the image state. Entry
+ * handles and names stay valid until the image is closed.
+ *
+ * Paths are UTF-8, relative to the root of the image, use either / or \ as
+ * the separator and are matched without regard to case.
+ *
+ * No function throws; failures to allocate are reported as XISO_ERROR_MEMORY.
+ */
+
+#ifndef XISO_H
+#define XISO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32) && defined(XISO_SHARED)
+#ifdef XISO_BUILDING
+#define XISO_API __declspec(dllexport)
+#else
+#define XISO_API __declspec(dllimport)
+#endif
+#elif defined(XISO_SHARED)
+#define XISO_API __attribute__((visibility("default")))
+#else
+#define XISO_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define XISO_API_VERSION 2
+
+typedef struct xiso_image xiso_image;
+typedef uint64_t xiso_handle;
+
+#define XISO_INVALID_HANDLE ((xiso_handle)-1)
+
+typedef enum xiso_result {
+  XISO_OK = 0,
+  XISO_ERROR_ARGUMENT = -1,
+  XISO_ERROR_FILE = -2,       /* image could not be opened or read */
+  XISO_ERROR_FORMAT = -3,     /* not an Xbox ISO image */
+  XISO_ERROR_NOT_FOUND = -4,
+  XISO_ERROR_NOT_DIRECTORY = -5,
+  XISO_ERROR_IS_DIRECTORY = -6,
+  XISO_ERROR_MEMORY = -7
+} xiso_result;
+
+/* Flags for xiso_open */
+#define XISO_OPEN_DIRECT 0x1   /* bypass the OS file cache */
+#define XISO_OPEN_RESIDENT 0x2 /* load the game partition into memory */
+
+/* Attribute bits, as stored in the image */
+#define XISO_ATTRIBUTE_READONLY 0x01
+#define XISO_ATTRIBUTE_HIDDEN 0x02
+#define XISO_ATTRIBUTE_SYSTEM 0x04
+#define XISO_ATTRIBUTE_DIRECTORY 0x10
+#define XISO_ATTRIBUTE_ARCHIVE 0x20
+#define XISO_ATTRIBUTE_NORMAL 0x80
+
+typedef struct xiso_stat {
+  xiso_handle handle;
+  xiso_handle parent;    /* XISO_INVALID_HANDLE for the root */
+  const char *name;      /* empty for the root */
+  uint64_t size;         /* 0 for directories */
+  uint64_t modified;     /* FILETIME of the volume */
+  uint32_t start_sector; /* relative to the game partition */
+  uint8_t attributes;
+  uint8_t is_directory;
+} xiso_stat;
+
+typedef struct xiso_dirent {
+  xiso_handle handle;
+  const char *name;
+  uint64_t size;
+  uint8_t attributes;
+  uint8_t is_directory;
+} xiso_dirent;
+
+/* Returns XISO_API_VERSION of the library; compare with the header */
+XISO_API uint32_t xiso_api_version(void);
+
+/*
+ * The first image opened starts watching for system memory pressure, as the
+ * mounting tool does; under pressure, reclaimable memory held for images is
+ * freed in the background.
+ */
+XISO_API xiso_result xiso_open(const char *path, uint32_t flags,
+                               xiso_image **image);
+XISO_API void xiso_close(xiso_image *image);
+
+/*
+ * Budget in bytes for the memory held for images in this process, 0 for no
+ * limit (the default). Reclaimable memory past it is freed in the background;
+ * memory loaded with XISO_OPEN_RESIDENT is counted but never freed. Since
+ * version 2.
+ */
+XISO_API void xiso_set_memory_budget(uint64_t bytes);
+
+XISO_API xiso_handle xiso_root(const xiso_image *image);
+XISO_API size_t xiso_entry_count(const xiso_image *image);
+
+XISO_API xiso_result xiso_lookup(const xiso_image *image, const char *path,
+                                 xiso_handle *handle);
+XISO_API xiso_result xiso_stat_handle(const xiso_image *image,
+                                      xiso_handle handle, xiso_stat *stat);
+
+/*
+ * Lists up to capacity children of a directory, starting at *cursor (0 for
+ * the first call). On return *count holds the number listed and *cursor the
+ * position to continue from; a count of 0 marks the end of the directory.
+ */
+XISO_API xiso_result xiso_readdir(const xiso_image *image,
+                                  xiso_handle directory, uint64_t *cursor,
+                                  xiso_dirent *entries, size_t capacity,
+                                  size_t *count);
+
+/*
+ * Positional read of a file. Returns the number of bytes read, which is less
+ * than length only at the end of the file, or a negative xiso_result:
+ * XISO_ERROR_FILE when the image could not be read.
+ */
+XISO_API int64_t xiso_pread(const xiso_image *image, xiso_handle handle,
+                            void *buffer, uint64_t length, uint64_t offset);
+
+/*
+ * Writes the image as an uncompressed EROFS image to the UTF-8 path, which
+ * Linux mounts read-only with "mount -t erofs -o loop". Names are kept as
+ * stored, so lookups in the mounted copy are case sensitive. Since version 2.
+ */
+XISO_API xiso_result xiso_export_erofs(const xiso_image *image,
+                                       const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* XISO_H */
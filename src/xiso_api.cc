@@ -0,0 +1,254 @@
+// Part of xbox-iso-vfs
+
+#include "xiso.h"
+
+#include "vfs.h"
+#include "vfs_erofs.h"
+#include "vfs_memory.h"
+#include "vfs_resident.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <limits>
+#include <memory>
+#include <new>
+#include <string>
+
+struct xiso_image {
+  vfs::Container container;
+};
+
+namespace {
+const xdvdfs::FileEntry *getEntry(const xiso_image *image,
+                                  xiso_handle handle) {
+  if (!image || handle >= image->container.getEntryCount()) {
+    return nullptr;
+  }
+
+  return image->container.getEntry(static_cast<size_t>(handle));
+}
+
+// The root entry is named after the path separator internally
+const char *getName(const xiso_image *image, xiso_handle handle) {
+  if (handle == 0) {
+    return "";
+  }
+
+  return image->container.getEntry(static_cast<size_t>(handle))
+      ->getFilename()
+      .c_str();
+}
+
+// No exception may cross the C interface
+template <class Function>
+auto guarded(Function function) noexcept -> decltype(function()) {
+  try {
+    return function();
+  } catch (const std::bad_alloc &) {
+    return XISO_ERROR_MEMORY;
+  } catch (...) {
+    return XISO_ERROR_FILE;
+  }
+}
+} // namespace
+
+extern "C" {
+uint32_t xiso_api_version(void) { return XISO_API_VERSION; }
+
+xiso_result xiso_open(const char *path, uint32_t flags, xiso_image **image) {
+  if (!path || !image) {
+    return XISO_ERROR_ARGUMENT;
+  }
+
+  *image = nullptr;
+
+  // Unavailable on some systems, which only loses the pressure response
+  try {
+    vfs::MemoryGovernor::getDefault().startPressureMonitor();
+  } catch (...) {
+  }
+
+  return guarded([&]() {
+    auto result = std::make_unique<xiso_image>();
+
+    // The path is kept in its native form; converting it to a wide string
+    // fails on Linux for names outside the locale
+    auto status = result->container.setup(std::filesystem::u8path(path),
+                                          (flags & XISO_OPEN_DIRECT) != 0);
+    if (status != vfs::SetupState::Success) {
+      return status == vfs::SetupState::ErrorFormat ? XISO_ERROR_FORMAT
+                                                    : XISO_ERROR_FILE;
+    }
+
+    if (flags & XISO_OPEN_RESIDENT) {
+      if (!vfs::makeResident(result->container, {}).success) {
+        return XISO_ERROR_MEMORY;
+      }
+    }
+
+    *image = result.release();
+    return XISO_OK;
+  });
+}
+
+void xiso_close(xiso_image *image) {
+  try {
+    delete image;
+  } catch (...) {
+  }
+}
+
+void xiso_set_memory_budget(uint64_t bytes) {
+  try {
+    vfs::MemoryGovernor::getDefault().setBudget(bytes);
+  } catch (...) {
+  }
+}
+
+xiso_handle xiso_root(const xiso_image *image) {
+  return image ? 0 : XISO_INVALID_HANDLE;
+}
+
+size_t xiso_entry_count(const xiso_image *image) {
+  return image ? image->container.getEntryCount() : 0;
+}
+
+xiso_result xiso_lookup(const xiso_image *image, const char *path,
+                        xiso_handle *handle) {
+  if (!image || !path || !handle) {
+    return XISO_ERROR_ARGUMENT;
+  }
+
+  *handle = XISO_INVALID_HANDLE;
+
+  return guarded([&]() {
+    auto found = image->container.lookupPath(path);
+    if (found == vfs::Container::sc_invalidHandle) {
+      return XISO_ERROR_NOT_FOUND;
+    }
+
+    *handle = found;
+    return XISO_OK;
+  });
+}
+
+xiso_result xiso_stat_handle(const xiso_image *image, xiso_handle handle,
+                             xiso_stat *stat) {
+  if (!stat) {
+    return XISO_ERROR_ARGUMENT;
+  }
+
+  return guarded([&]() {
+    auto entry = getEntry(image, handle);
+    if (!entry) {
+      return XISO_ERROR_NOT_FOUND;
+    }
+
+    auto parent =
+        image->container.getParentHandle(static_cast<size_t>(handle));
+
+    stat->handle = handle;
+    stat->parent = parent == vfs::Container::sc_invalidHandle
+                       ? XISO_INVALID_HANDLE
+                       : static_cast<xiso_handle>(parent);
+    stat->name = getName(image, handle);
+    stat->size = entry->isDirectory() ? 0 : entry->getFileSize();
+    stat->modified = image->container.getVolumeModified();
+    stat->start_sector = entry->getStartSector();
+    stat->attributes = entry->getAttributes();
+    stat->is_directory = entry->isDirectory() ? 1 : 0;
+
+    return XISO_OK;
+  });
+}
+
+xiso_result xiso_readdir(const xiso_image *image, xiso_handle directory,
+                         uint64_t *cursor, xiso_dirent *entries,
+                         size_t capacity, size_t *count) {
+  if (!cursor || !count || (!entries && capacity > 0)) {
+    return XISO_ERROR_ARGUMENT;
+  }
+
+  *count = 0;
+
+  return guarded([&]() {
+    auto entry = getEntry(image, directory);
+    if (!entry) {
+      return XISO_ERROR_NOT_FOUND;
+    }
+    if (!entry->isDirectory()) {
+      return XISO_ERROR_NOT_DIRECTORY;
+    }
+
+    auto page = image->container.getListing(static_cast<size_t>(directory),
+                                            static_cast<size_t>(*cursor),
+                                            capacity);
+
+    for (size_t i = 0; i < page.count; ++i) {
+      const auto &record = page.records[i];
+      auto child = image->container.getEntry(record.handle);
+
+      auto &dirent = entries[i];
+      dirent.handle = record.handle;
+      dirent.name = child->getFilename().c_str();
+      dirent.size = child->isDirectory() ? 0 : child->getFileSize();
+      dirent.attributes = child->getAttributes();
+      dirent.is_directory = child->isDirectory() ? 1 : 0;
+    }
+
+    *count = page.count;
+    *cursor = page.next;
+
+    return XISO_OK;
+  });
+}
+
+int64_t xiso_pread(const xiso_image *image, xiso_handle handle, void *buffer,
+                   uint64_t length, uint64_t offset) {
+  if (!buffer && length > 0) {
+    return XISO_ERROR_ARGUMENT;
+  }
+
+  return guarded([&]() -> int64_t {
+    auto entry = getEntry(image, handle);
+    if (!entry) {
+      return XISO_ERROR_NOT_FOUND;
+    }
+    if (entry->isDirectory()) {
+      return XISO_ERROR_IS_DIRECTORY;
+    }
+
+    if (offset >= entry->getFileSize()) {
+      return 0;
+    }
+
+    // Files are at most 4 GiB, so a single read always covers the request
+    auto readLength = static_cast<uint32_t>(std::min<uint64_t>(
+        {length, std::numeric_limits<uint32_t>::max(),
+         entry->getFileSize() - offset}));
+
+    // The end of the file is already accounted for, so anything shorter is
+    // a failure to read the image
+    auto bytesRead = image->container.readEntry(
+        static_cast<size_t>(handle), buffer, readLength,
+        static_cast<int64_t>(offset));
+    if (bytesRead != readLength) {
+      return XISO_ERROR_FILE;
+    }
+
+    return bytesRead;
+  });
+}
+
+xiso_result xiso_export_erofs(const xiso_image *image, const char *path) {
+  if (!image || !path) {
+    return XISO_ERROR_ARGUMENT;
+  }
+
+  return guarded([&]() {
+    auto report =
+        vfs::exportErofs(image->container, std::filesystem::u8path(path));
+    return report.success ? XISO_OK : XISO_ERROR_FILE;
+  });
+}
+}